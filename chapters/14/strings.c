@@ -1,8 +1,45 @@
+#define _POSIX_C_SOURCE 200112L
+/* For MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+
 #include <stdbool.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+/* 'load' maps its file, and the JIT takes its pages from mmap too */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The JIT reads how far the stack may grow */
+#include <sys/resource.h>
+
+/* The JIT emits x86-64 */
+#if defined(__x86_64__) && defined(__linux__)
+#define LISP_JIT_NATIVE
+#endif
+
+/* The reader classifies text with SSE2 or AVX2, chosen when it runs */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LISP_SCAN_SIMD
+#include <immintrin.h>
+#endif
+
+/* Large files can be read on several threads, each of which allocates from a
+ * heap of its own, where there is thread-local storage to say which */
+#ifdef __GNUC__
+#define LISP_READ_THREADS
+#define LISP_THREAD_LOCAL __thread
+#include <pthread.h>
+#else
+#define LISP_THREAD_LOCAL
+#endif
 
 #include <editline/readline.h>
 
@@ -23,23 +60,64 @@ typedef struct lisp_value lisp_value;
 struct lisp_environment;
 typedef struct lisp_environment lisp_environment;
 
-typedef lisp_value* (*lisp_builtin)(lisp_environment*, lisp_value*);
+struct lisp_heap;
+typedef struct lisp_heap lisp_heap;
 
-struct lisp_value {
-    int type;
+struct lisp_code;
+typedef struct lisp_code lisp_code;
 
-    long number;
-    char* error;
-    char* symbol;
-    char* string;
+struct lisp_jit;
+typedef struct lisp_jit lisp_jit;
 
-    lisp_builtin builtin;
-    lisp_environment* environment;
-    lisp_value* formals;
-    lisp_value* body;
+struct lisp_node;
+typedef struct lisp_node lisp_node;
 
-    size_t count;
-    lisp_value** cell;
+typedef lisp_value* (*lisp_builtin)(lisp_environment*, lisp_value*);
+
+/* Values are reference counted and shared freely. Anything that changes a
+ * value in place must first call lisp_value_unshare, which copies it if anyone
+ * else can see it.
+ *
+ * Only the payload of the value's type is stored. It comes first so that the
+ * free list link of an unused block overlays it and leaves "references" at
+ * zero. */
+struct lisp_value {
+    union {
+        long number;
+        /* Strings and errors short enough for "inline_text" are kept in the
+         * node itself. A symbol points at its interned name and remembers
+         * the frame slot it was resolved to (see lisp_value_resolve). */
+        struct {
+            union {
+                char* error;
+                char* symbol;
+                char* string;
+            };
+            union {
+                char inline_text[16];
+                size_t slot;
+            };
+        };
+        /* A builtin has no formals */
+        struct {
+            union {
+                lisp_builtin builtin;
+                lisp_environment* environment;
+            };
+            lisp_value* formals;
+            lisp_value* body;
+        };
+        /* An expression that has run as a function body keeps its bytecode */
+        struct {
+            size_t count;
+            lisp_value** cell;
+            lisp_code* code;
+        };
+    };
+
+    uint32_t references;
+    unsigned char type;
+    bool marked;
 };
 
 enum {
@@ -52,51 +130,568 @@ enum {
     LISP_VALUE_STRING
 };
 
+/* Environments with more bindings than this get a hash index of their slots.
+ * Smaller ones, like most function frames, are just scanned. */
+#define LISP_ENVIRONMENT_INDEX_MIN 8
+/* How many slots each put moves into a growing index */
+#define LISP_ENVIRONMENT_MIGRATE 4
+
 struct lisp_environment {
     lisp_environment* parent; /* Do not delete parent */
+    lisp_heap* heap;          /* Where the values it holds have to live */
     size_t count;
+    size_t capacity;
     char** symbols;
     lisp_value** values;
+
+    /* Open addressing from interned symbol to slot + 1, where 0 is an empty
+     * bucket. The index grows incrementally: the slots below "old_count" are
+     * in "old_index" and move over to "index" a few per put, so only the
+     * ones below "migrated" are certain to be in "index" already. */
+    size_t* index;
+    size_t index_capacity;
+    size_t* old_index;
+    size_t old_capacity;
+    size_t old_count;
+    size_t migrated;
 };
 
-lisp_value* lisp_value_builtin(lisp_builtin const builtin) {
+/* Numbers that fit in 63 bits and empty expressions never touch the heap:
+ * they are encoded in the pointer itself. A set low bit marks a number
+ * shifted left by one, and the two empty expressions are small constants.
+ * Anything that might be one of these goes through the accessors below
+ * instead of the fields. */
+#define LISP_VALUE_EMPTY_SEXPRESSION ((lisp_value*)2)
+#define LISP_VALUE_EMPTY_QEXPRESSION ((lisp_value*)4)
+#define LISP_VALUE_FIXNUM_MIN (LONG_MIN / 2)
+#define LISP_VALUE_FIXNUM_MAX (LONG_MAX / 2)
+
+bool lisp_value_is_immediate(const lisp_value* const value) {
+    return ((uintptr_t)value & 7) != 0;
+}
+
+bool lisp_value_is_fixnum(const lisp_value* const value) {
+    return ((uintptr_t)value & 1) != 0;
+}
+
+int lisp_value_type(const lisp_value* const value) {
+    if (lisp_value_is_fixnum(value)) {
+        return LISP_VALUE_NUMBER;
+    }
+    if (value == LISP_VALUE_EMPTY_SEXPRESSION) {
+        return LISP_VALUE_SEXPRESSION;
+    }
+    if (value == LISP_VALUE_EMPTY_QEXPRESSION) {
+        return LISP_VALUE_QEXPRESSION;
+    }
+    return value->type;
+}
+
+long lisp_value_get_number(const lisp_value* const value) {
+    if (lisp_value_is_fixnum(value)) {
+        return (long)((intptr_t)value >> 1);
+    }
+    return value->number;
+}
+
+size_t lisp_value_count(const lisp_value* const value) {
+    return lisp_value_is_immediate(value) ? 0 : value->count;
+}
+
+/* How many times this thread asked the system allocator for memory, for
+ * --bench-memory */
+LISP_THREAD_LOCAL size_t lisp_system_allocations = 0;
+
+/* Values, their cell vectors, strings and environments all come from
+ * size-class slab heaps rather than from one malloc each. New memory is taken
+ * from lisp_heap_current: the global heap for whatever the global environment
+ * holds, and the evaluation arena for the temporaries of a top-level
+ * evaluation. The arena is dropped wholesale once that evaluation is done, so
+ * anything stored into an environment is copied into the environment's own
+ * heap. Build with -DLISP_ALLOCATOR_MALLOC to use plain malloc instead.
+ */
+
+#ifdef LISP_ALLOCATOR_MALLOC
+
+void* lisp_allocate(const size_t size) {
+    lisp_system_allocations += 1;
+    return malloc(size);
+}
+
+void* lisp_reallocate(void* const pointer, const size_t size) {
+    lisp_system_allocations += 1;
+    return realloc(pointer, size);
+}
+
+void lisp_free(void* const pointer) { free(pointer); }
+
+lisp_value* lisp_value_allocate() {
+    lisp_system_allocations += 1;
     lisp_value* value = malloc(sizeof(lisp_value));
+    value->marked = false;
+    return value;
+}
+
+lisp_heap* lisp_heap_of(const void* const pointer) { return NULL; }
+
+lisp_heap* lisp_heap_enter(lisp_heap* const heap) { return NULL; }
+
+lisp_heap* lisp_heap_long_lived() { return NULL; }
+
+lisp_heap* lisp_heap_arena() { return NULL; }
+
+lisp_heap* lisp_heap_new() { return NULL; }
+
+void lisp_heap_adopt(lisp_heap* const heap, lisp_heap* const from) {}
+
+bool lisp_heap_holds(const lisp_heap* const heap, const void* const pointer) {
+    return true;
+}
+
+bool lisp_heap_is_current(const void* const pointer) { return true; }
+
+size_t lisp_heap_bytes(const lisp_heap* const heap) { return 0; }
+
+#else
+
+#define LISP_HEAP_PAGE_SIZE 65536
+#define LISP_HEAP_HEADER_SIZE 64
+#define LISP_HEAP_CLASS_COUNT 12
+/* Values get pages of their own so that the collector can walk them */
+#define LISP_HEAP_VALUES LISP_HEAP_CLASS_COUNT
+#define LISP_HEAP_LARGE (LISP_HEAP_CLASS_COUNT + 1)
+
+typedef struct lisp_heap_page lisp_heap_page;
+typedef struct lisp_heap_block lisp_heap_block;
+
+struct lisp_heap_block {
+    lisp_heap_block* next;
+};
+
+/* Header at the start of every page-aligned chunk, so any pointer into the
+ * first page finds it by masking. A large allocation gets a chunk of its own
+ * with size_class LISP_HEAP_LARGE. */
+struct lisp_heap_page {
+    lisp_heap* heap;
+    lisp_heap_page* previous;
+    lisp_heap_page* next;
+    size_t size_class;
+    size_t size;
+};
+
+struct lisp_heap {
+    lisp_heap_block* free[LISP_HEAP_LARGE];
+    lisp_heap_page* pages;
+    size_t bytes;
+};
+
+const size_t lisp_heap_block_sizes[LISP_HEAP_LARGE] = {
+    16,  32,  48,   64,   80,   96, 112, 128,
+    256, 512, 1024, 2048, (sizeof(lisp_value) + 15) / 16 * 16};
+
+lisp_heap lisp_heap_global;
+lisp_heap lisp_heap_evaluation;
+LISP_THREAD_LOCAL lisp_heap* lisp_heap_current = &lisp_heap_global;
+
+size_t lisp_heap_class(const size_t size) {
+    if (size <= 128) {
+        return size == 0 ? 0 : (size - 1) / 16;
+    }
+    size_t size_class = 8;
+    while (size_class < LISP_HEAP_CLASS_COUNT &&
+           lisp_heap_block_sizes[size_class] < size) {
+        size_class += 1;
+    }
+    return size_class < LISP_HEAP_CLASS_COUNT ? size_class : LISP_HEAP_LARGE;
+}
+
+lisp_heap_page* lisp_heap_page_of(const void* const pointer) {
+    return (lisp_heap_page*)((uintptr_t)pointer &
+                             ~(uintptr_t)(LISP_HEAP_PAGE_SIZE - 1));
+}
+
+lisp_heap* lisp_heap_of(const void* const pointer) {
+    return lisp_heap_page_of(pointer)->heap;
+}
+
+/* Pages dropped with the arena are kept for the next evaluation rather than
+ * handed back to malloc, which may return them to the system only to fault
+ * them in again for the next top-level form */
+#define LISP_HEAP_SPARE_PAGES 64
+
+LISP_THREAD_LOCAL lisp_heap_page* lisp_heap_spare = NULL;
+LISP_THREAD_LOCAL size_t lisp_heap_spare_count = 0;
+
+lisp_heap_page* lisp_heap_page_new(lisp_heap* const heap,
+                                   const size_t size_class, const size_t size) {
+    void* memory;
+    if (size == LISP_HEAP_PAGE_SIZE && lisp_heap_spare != NULL) {
+        memory = lisp_heap_spare;
+        lisp_heap_spare = lisp_heap_spare->next;
+        lisp_heap_spare_count -= 1;
+    } else if (posix_memalign(&memory, LISP_HEAP_PAGE_SIZE, size) != 0) {
+        fputs("Out of memory.\n", stderr);
+        exit(1);
+    } else {
+        lisp_system_allocations += 1;
+    }
+    lisp_heap_page* page = memory;
+    page->heap = heap;
+    page->previous = NULL;
+    page->next = heap->pages;
+    page->size_class = size_class;
+    page->size = size;
+    if (heap->pages != NULL) {
+        heap->pages->previous = page;
+    }
+    heap->pages = page;
+    return page;
+}
+
+void lisp_heap_grow(lisp_heap* const heap, const size_t size_class) {
+    lisp_heap_page* page =
+        lisp_heap_page_new(heap, size_class, LISP_HEAP_PAGE_SIZE);
+    size_t block_size = lisp_heap_block_sizes[size_class];
+    char* block = (char*)page + LISP_HEAP_HEADER_SIZE;
+    char* end = (char*)page + LISP_HEAP_PAGE_SIZE - block_size;
+    if (size_class == LISP_HEAP_VALUES) {
+        /* A value with no references is a free block */
+        memset(block, 0, end + block_size - block);
+    }
+    for (; block <= end; block += block_size) {
+        ((lisp_heap_block*)block)->next = heap->free[size_class];
+        heap->free[size_class] = (lisp_heap_block*)block;
+    }
+}
+
+void* lisp_heap_allocate_class(lisp_heap* const heap, const size_t size_class,
+                               const size_t size) {
+    if (size_class == LISP_HEAP_LARGE) {
+        lisp_heap_page* page = lisp_heap_page_new(
+            heap, LISP_HEAP_LARGE, LISP_HEAP_HEADER_SIZE + size);
+        heap->bytes += page->size;
+        return (char*)page + LISP_HEAP_HEADER_SIZE;
+    }
+    if (heap->free[size_class] == NULL) {
+        lisp_heap_grow(heap, size_class);
+    }
+    lisp_heap_block* block = heap->free[size_class];
+    heap->free[size_class] = block->next;
+    heap->bytes += lisp_heap_block_sizes[size_class];
+    return block;
+}
+
+void* lisp_heap_allocate(lisp_heap* const heap, const size_t size) {
+    return lisp_heap_allocate_class(heap, lisp_heap_class(size), size);
+}
+
+void* lisp_allocate(const size_t size) {
+    return lisp_heap_allocate(lisp_heap_current, size);
+}
+
+lisp_value* lisp_value_allocate() {
+    lisp_value* value = lisp_heap_allocate_class(
+        lisp_heap_current, LISP_HEAP_VALUES, sizeof(lisp_value));
+    value->marked = false;
+    return value;
+}
+
+void lisp_free(void* const pointer) {
+    if (pointer == NULL) {
+        return;
+    }
+    lisp_heap_page* page = lisp_heap_page_of(pointer);
+    lisp_heap* heap = page->heap;
+    if (page->size_class == LISP_HEAP_LARGE) {
+        if (page->previous != NULL) {
+            page->previous->next = page->next;
+        } else {
+            heap->pages = page->next;
+        }
+        if (page->next != NULL) {
+            page->next->previous = page->previous;
+        }
+        heap->bytes -= page->size;
+        free(page);
+        return;
+    }
+    if (page->size_class == LISP_HEAP_VALUES) {
+        ((lisp_value*)pointer)->references = 0;
+    }
+    lisp_heap_block* block = pointer;
+    block->next = heap->free[page->size_class];
+    heap->free[page->size_class] = block;
+    heap->bytes -= lisp_heap_block_sizes[page->size_class];
+}
+
+void* lisp_reallocate(void* const pointer, const size_t size) {
+    if (pointer == NULL) {
+        return lisp_allocate(size);
+    }
+    if (size == 0) {
+        lisp_free(pointer);
+        return NULL;
+    }
+    /* Stay in the heap the memory already belongs to */
+    lisp_heap_page* page = lisp_heap_page_of(pointer);
+    size_t old_size;
+    if (page->size_class == LISP_HEAP_LARGE) {
+        old_size = page->size - LISP_HEAP_HEADER_SIZE;
+    } else {
+        if (lisp_heap_class(size) == page->size_class) {
+            return pointer;
+        }
+        old_size = lisp_heap_block_sizes[page->size_class];
+    }
+    void* x = lisp_heap_allocate(page->heap, size);
+    memcpy(x, pointer, old_size < size ? old_size : size);
+    lisp_free(pointer);
+    return x;
+}
+
+/* Make new allocations come from "heap" and return the previous heap */
+lisp_heap* lisp_heap_enter(lisp_heap* const heap) {
+    lisp_heap* previous = lisp_heap_current;
+    if (heap != NULL) {
+        lisp_heap_current = heap;
+    }
+    return previous;
+}
+
+/* Whether memory in "heap" may point at "pointer". The arena may point into
+ * the global heap, but never the other way around. */
+lisp_heap* lisp_heap_long_lived() { return &lisp_heap_global; }
+
+lisp_heap* lisp_heap_arena() { return &lisp_heap_evaluation; }
+
+bool lisp_heap_holds(const lisp_heap* const heap, const void* const pointer) {
+    return heap == &lisp_heap_evaluation || lisp_heap_of(pointer) == heap;
+}
+
+bool lisp_heap_is_current(const void* const pointer) {
+    return lisp_heap_of(pointer) == lisp_heap_current;
+}
+
+size_t lisp_heap_bytes(const lisp_heap* const heap) { return heap->bytes; }
+
+/* A heap of its own for a thread reading part of a file */
+lisp_heap* lisp_heap_new() { return calloc(1, sizeof(lisp_heap)); }
+
+/* Move the pages of "from" into "heap", and free "from" */
+void lisp_heap_adopt(lisp_heap* const heap, lisp_heap* const from) {
+    lisp_heap_page* last = NULL;
+    for (lisp_heap_page* page = from->pages; page != NULL; page = page->next) {
+        page->heap = heap;
+        last = page;
+    }
+    if (last != NULL) {
+        last->next = heap->pages;
+        if (heap->pages != NULL) {
+            heap->pages->previous = last;
+        }
+        heap->pages = from->pages;
+    }
+    for (size_t i = 0; i < LISP_HEAP_LARGE; i += 1) {
+        lisp_heap_block* block = from->free[i];
+        if (block == NULL) {
+            continue;
+        }
+        while (block->next != NULL) {
+            block = block->next;
+        }
+        block->next = heap->free[i];
+        heap->free[i] = from->free[i];
+    }
+    heap->bytes += from->bytes;
+    free(from);
+}
+
+void lisp_heap_clear(lisp_heap* const heap) {
+    while (heap->pages != NULL) {
+        lisp_heap_page* page = heap->pages;
+        heap->pages = page->next;
+        if (page->size == LISP_HEAP_PAGE_SIZE &&
+            lisp_heap_spare_count < LISP_HEAP_SPARE_PAGES) {
+            page->next = lisp_heap_spare;
+            lisp_heap_spare = page;
+            lisp_heap_spare_count += 1;
+        } else {
+            free(page);
+        }
+    }
+    for (size_t i = 0; i < LISP_HEAP_LARGE; i += 1) {
+        heap->free[i] = NULL;
+    }
+    heap->bytes = 0;
+}
+
+#endif
+
+/* Symbol names are interned: each distinct name is stored once, for the life
+ * of the program and outside the heaps, so symbols compare by pointer. The
+ * table uses open addressing with linear probing. */
+typedef struct {
+    size_t count;
+    size_t capacity;
+    char** names;
+} lisp_symbol_table;
+
+lisp_symbol_table lisp_symbols = {0, 0, NULL};
+char* lisp_symbol_ampersand = NULL;
+char* lisp_symbol_if = NULL;
+
+size_t lisp_symbol_hash(const char* const name, const size_t length) {
+    /* FNV-1a */
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i += 1) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void lisp_symbol_table_grow(lisp_symbol_table* const table) {
+    size_t capacity = table->capacity == 0 ? 256 : table->capacity * 2;
+    char** names = calloc(capacity, sizeof(char*));
+    for (size_t i = 0; i < table->capacity; i += 1) {
+        if (table->names[i] == NULL) {
+            continue;
+        }
+        size_t j = lisp_symbol_hash(table->names[i], strlen(table->names[i])) &
+                   (capacity - 1);
+        while (names[j] != NULL) {
+            j = (j + 1) & (capacity - 1);
+        }
+        names[j] = table->names[i];
+    }
+    free(table->names);
+    table->names = names;
+    table->capacity = capacity;
+}
+
+char* lisp_symbol_intern_hashed(const char* const name, const size_t length,
+                                const size_t hash) {
+    if ((lisp_symbols.count + 1) * 2 > lisp_symbols.capacity) {
+        lisp_symbol_table_grow(&lisp_symbols);
+    }
+    size_t mask = lisp_symbols.capacity - 1;
+    size_t i = hash & mask;
+    while (lisp_symbols.names[i] != NULL) {
+        if (strncmp(lisp_symbols.names[i], name, length) == 0 &&
+            lisp_symbols.names[i][length] == '\0') {
+            return lisp_symbols.names[i];
+        }
+        i = (i + 1) & mask;
+    }
+    lisp_symbols.names[i] = malloc(length + 1);
+    memcpy(lisp_symbols.names[i], name, length);
+    lisp_symbols.names[i][length] = '\0';
+    lisp_symbols.count += 1;
+    return lisp_symbols.names[i];
+}
+
+/* Intern the "length" characters at "name", which need not be terminated */
+char* lisp_symbol_intern_text(const char* const name, const size_t length) {
+    return lisp_symbol_intern_hashed(name, length,
+                                     lisp_symbol_hash(name, length));
+}
+
+#ifdef LISP_READ_THREADS
+
+/* Threads reading at once intern through a cache of names each has met, and
+ * take the lock on the table only for a name that is not in it */
+#define LISP_SYMBOL_CACHE_SIZE 1024
+
+pthread_mutex_t lisp_symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char* lisp_symbol_intern_shared(char** const cache, const char* const name,
+                                const size_t length) {
+    size_t hash = lisp_symbol_hash(name, length);
+    char** slot = &cache[hash & (LISP_SYMBOL_CACHE_SIZE - 1)];
+    if (*slot != NULL && strncmp(*slot, name, length) == 0 &&
+        (*slot)[length] == '\0') {
+        return *slot;
+    }
+    pthread_mutex_lock(&lisp_symbol_lock);
+    *slot = lisp_symbol_intern_hashed(name, length, hash);
+    pthread_mutex_unlock(&lisp_symbol_lock);
+    return *slot;
+}
+
+#endif
+
+char* lisp_symbol_intern(const char* const name) {
+    return lisp_symbol_intern_text(name, strlen(name));
+}
+
+lisp_value* lisp_value_builtin(lisp_builtin const builtin) {
+    lisp_value* value = lisp_value_allocate();
     value->type = LISP_VALUE_FUNCTION;
+    value->references = 1;
     value->builtin = builtin;
+    value->formals = NULL;
+    value->body = NULL;
     return value;
 }
 
+bool lisp_value_is_builtin(const lisp_value* const value) {
+    return value->formals == NULL;
+}
+
+/* Room for "size" bytes of text for "value", in the node itself if it fits */
+char* lisp_value_text(lisp_value* const value, const size_t size) {
+    return size <= sizeof(value->inline_text) ? value->inline_text
+                                              : lisp_allocate(size);
+}
+
+/* Copy "text" for "value" */
+char* lisp_value_copy_text(lisp_value* const value, const char* const text) {
+    size_t size = strlen(text) + 1;
+    char* copy = lisp_value_text(value, size);
+    memcpy(copy, text, size);
+    return copy;
+}
+
+void lisp_value_free_text(lisp_value* const value) {
+    if (value->string != value->inline_text) {
+        lisp_free(value->string);
+    }
+}
+
 lisp_value* lisp_value_string(const char* const string) {
-    lisp_value* value = malloc(sizeof(lisp_value));
+    lisp_value* value = lisp_value_allocate();
     value->type = LISP_VALUE_STRING;
-    size_t size = strlen(string) + 1;
-    value->string = malloc(size);
-    strncpy(value->string, string, size);
+    value->references = 1;
+    value->string = lisp_value_copy_text(value, string);
     return value;
 }
 
 lisp_value* lisp_value_number(const long x) {
-    lisp_value* value = malloc(sizeof(lisp_value));
+    if (x >= LISP_VALUE_FIXNUM_MIN && x <= LISP_VALUE_FIXNUM_MAX) {
+        return (lisp_value*)(((uintptr_t)x << 1) | 1);
+    }
+    lisp_value* value = lisp_value_allocate();
     value->type = LISP_VALUE_NUMBER;
+    value->references = 1;
     value->number = x;
     return value;
 }
 
 lisp_value* lisp_value_error(const char* const fmt, ...) {
-    lisp_value* value = malloc(sizeof(lisp_value));
+    lisp_value* value = lisp_value_allocate();
     value->type = LISP_VALUE_ERROR;
+    value->references = 1;
 
     /* Create a va list and initialize it */
     va_list va;
     va_start(va, fmt);
 
-    value->error = malloc(512);
+    char error[512];
 
     /* printf the error string with a maximum of 511 characters */
-    vsnprintf(value->error, 511, fmt, va);
+    vsnprintf(error, 511, fmt, va);
 
-    /* Reallocate to number of bytes actually used */
-    value->error = realloc(value->error, strlen(value->error) + 1);
+    /* Allocate the number of bytes actually used */
+    value->error = lisp_value_copy_text(value, error);
 
     /* Cleanup our va list */
     va_end(va);
@@ -104,157 +699,508 @@ lisp_value* lisp_value_error(const char* const fmt, ...) {
     return value;
 }
 
-lisp_value* lisp_value_symbol(const char* const s) {
-    lisp_value* value = malloc(sizeof(lisp_value));
+/* The symbol for the interned "name" */
+lisp_value* lisp_value_symbol_interned(char* const name) {
+    lisp_value* value = lisp_value_allocate();
     value->type = LISP_VALUE_SYMBOL;
-    size_t size = strlen(s) + 1;
-    value->symbol = malloc(size);
-    strncpy(value->symbol, s, size);
+    value->references = 1;
+    value->symbol = name;
+    value->slot = SIZE_MAX;
     return value;
 }
 
-lisp_value* lisp_value_qexpression() {
-    lisp_value* value = malloc(sizeof(lisp_value));
-    value->type = LISP_VALUE_QEXPRESSION;
-    value->count = 0;
-    value->cell = NULL;
-    return value;
+/* The symbol named by the "length" characters at "s" */
+lisp_value* lisp_value_symbol_text(const char* const s, const size_t length) {
+    return lisp_value_symbol_interned(lisp_symbol_intern_text(s, length));
 }
 
-lisp_value* lisp_value_sexpression() {
-    lisp_value* value = malloc(sizeof(lisp_value));
-    value->type = LISP_VALUE_SEXPRESSION;
-    value->count = 0;
-    value->cell = NULL;
-    return value;
+lisp_value* lisp_value_symbol(const char* const s) {
+    return lisp_value_symbol_text(s, strlen(s));
 }
 
-void lisp_environment_delete(lisp_environment* const environment);
+lisp_value* lisp_value_qexpression() { return LISP_VALUE_EMPTY_QEXPRESSION; }
 
-void lisp_value_delete(lisp_value* const value) {
+lisp_value* lisp_value_sexpression() { return LISP_VALUE_EMPTY_SEXPRESSION; }
+
+/* Give an immediate value a node of its own, for code that changes it */
+lisp_value* lisp_value_box(const lisp_value* const value) {
+    lisp_value* x = lisp_value_allocate();
+    x->type = lisp_value_type(value);
+    x->references = 1;
+    if (x->type == LISP_VALUE_NUMBER) {
+        x->number = lisp_value_get_number(value);
+    } else {
+        x->count = 0;
+        x->cell = NULL;
+        x->code = NULL;
+    }
+    return x;
+}
+
+/* Nested data can go deeper than the C stack would allow, so the walks
+ * through it keep what they still have to visit on stacks of their own: one
+ * of values for those that can visit the parts in any order, and one of the
+ * expressions they are in the middle of for those that cannot, like
+ * printing. Each thread's walks share the two. A walk only takes what is
+ * above the count it found and leaves the count as it found it, so that one
+ * can run inside another. */
+typedef struct {
+    lisp_value** values;
+    size_t count;
+    size_t capacity;
+} lisp_value_stack;
+
+typedef struct {
+    const lisp_value* value;
+    size_t next; /* How many of its parts have been visited */
+} lisp_walk_frame;
+
+typedef struct {
+    lisp_walk_frame* frames;
+    size_t count;
+    size_t capacity;
+} lisp_walk;
+
+LISP_THREAD_LOCAL lisp_value_stack lisp_value_pending = {NULL, 0, 0};
+LISP_THREAD_LOCAL lisp_walk lisp_walk_stack = {NULL, 0, 0};
+
+void lisp_value_push_pending(lisp_value* const value) {
+    lisp_value_stack* stack = &lisp_value_pending;
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity * 2 + 64;
+        stack->values =
+            realloc(stack->values, sizeof(lisp_value*) * stack->capacity);
+    }
+    stack->values[stack->count] = value;
+    stack->count += 1;
+}
+
+lisp_value* lisp_value_pop_pending() {
+    lisp_value_pending.count -= 1;
+    return lisp_value_pending.values[lisp_value_pending.count];
+}
+
+/* Start visiting the parts of "value" */
+void lisp_walk_enter(const lisp_value* const value) {
+    lisp_walk* walk = &lisp_walk_stack;
+    if (walk->count == walk->capacity) {
+        walk->capacity = walk->capacity * 2 + 64;
+        walk->frames =
+            realloc(walk->frames, sizeof(lisp_walk_frame) * walk->capacity);
+    }
+    walk->frames[walk->count].value = value;
+    walk->frames[walk->count].next = 0;
+    walk->count += 1;
+}
+
+lisp_walk_frame* lisp_walk_top() {
+    return &lisp_walk_stack.frames[lisp_walk_stack.count - 1];
+}
+
+void lisp_environment_free(lisp_environment* const environment);
+
+void lisp_code_free(lisp_code* const code);
+
+/* Drop a reference that a value being freed held, leaving what it pointed at
+ * to lisp_value_delete if that was the last one */
+void lisp_value_release(lisp_value* const value) {
+    if (lisp_value_is_immediate(value)) {
+        return;
+    }
+    value->references -= 1;
+    if (value->references == 0) {
+        lisp_value_push_pending(value);
+    }
+}
+
+/* Free a value nobody holds any more */
+void lisp_value_free(lisp_value* const value) {
     switch (value->type) {
         case LISP_VALUE_NUMBER:
             break;
         case LISP_VALUE_FUNCTION:
-            if (value->builtin == NULL) {
-                lisp_environment_delete(value->environment);
-                lisp_value_delete(value->formals);
-                lisp_value_delete(value->body);
+            if (!lisp_value_is_builtin(value)) {
+                lisp_environment* environment = value->environment;
+                for (size_t i = 0; i < environment->count; i += 1) {
+                    lisp_value_release(environment->values[i]);
+                }
+                lisp_environment_free(environment);
+                lisp_value_release(value->formals);
+                lisp_value_release(value->body);
             }
             break;
         case LISP_VALUE_STRING:
-            free(value->string);
-            break;
-        case LISP_VALUE_SYMBOL:
-            free(value->symbol);
-            break;
         case LISP_VALUE_ERROR:
-            free(value->error);
+            lisp_value_free_text(value);
             break;
         case LISP_VALUE_QEXPRESSION:
         case LISP_VALUE_SEXPRESSION:
             for (size_t i = 0; i < value->count; i += 1) {
-                lisp_value_delete(value->cell[i]);
+                lisp_value_release(value->cell[i]);
             }
-            free(value->cell);
+            lisp_free(value->cell);
+            lisp_code_free(value->code);
             break;
     }
-    free(value);
+    lisp_free(value);
+}
+
+/* Drop one reference and free the value once nobody holds it, along with
+ * whatever it held the last reference to */
+void lisp_value_delete(lisp_value* const value) {
+    if (lisp_value_is_immediate(value)) {
+        return;
+    }
+    value->references -= 1;
+    if (value->references > 0) {
+        return;
+    }
+    size_t base = lisp_value_pending.count;
+    lisp_value_free(value);
+    while (lisp_value_pending.count > base) {
+        lisp_value_free(lisp_value_pop_pending());
+    }
+}
+
+lisp_value* lisp_value_retain(lisp_value* const value) {
+    if (lisp_value_is_immediate(value)) {
+        return value;
+    }
+    value->references += 1;
+    return value;
 }
 
 lisp_environment* lisp_environment_copy(
     const lisp_environment* const environment);
 
+/* Copy the outer node only; the copy shares its children with "value" */
 lisp_value* lisp_value_copy(const lisp_value* const value) {
-    lisp_value* x = malloc(sizeof(lisp_value));
+    if (lisp_value_is_immediate(value)) {
+        return (lisp_value*)value;
+    }
+    lisp_value* x = lisp_value_allocate();
     x->type = value->type;
+    x->references = 1;
     switch (value->type) {
         case LISP_VALUE_FUNCTION:
-            if (value->builtin != NULL) {
+            if (lisp_value_is_builtin(value)) {
                 x->builtin = value->builtin;
+                x->formals = NULL;
+                x->body = NULL;
             } else {
-                x->builtin = NULL;
                 x->environment = lisp_environment_copy(value->environment);
-                x->formals = lisp_value_copy(value->formals);
-                x->body = lisp_value_copy(value->body);
+                x->formals = lisp_value_retain(value->formals);
+                x->body = lisp_value_retain(value->body);
             }
             break;
         case LISP_VALUE_NUMBER:
             x->number = value->number;
             break;
-        case LISP_VALUE_STRING: {
-            size_t size = strlen(value->string) + 1;
-            x->string = malloc(size);
-            strncpy(x->string, value->string, size);
-            break;
-        }
-        case LISP_VALUE_ERROR: {
-            size_t size = strlen(value->error) + 1;
-            x->error = malloc(size);
-            strncpy(x->error, value->error, size);
+        case LISP_VALUE_STRING:
+        case LISP_VALUE_ERROR:
+            x->string = lisp_value_copy_text(x, value->string);
             break;
-        }
-        case LISP_VALUE_SYMBOL: {
-            size_t size = strlen(value->symbol) + 1;
-            x->symbol = malloc(size);
-            strncpy(x->symbol, value->symbol, size);
+        case LISP_VALUE_SYMBOL:
+            x->symbol = value->symbol;
+            x->slot = value->slot;
             break;
-        }
         case LISP_VALUE_QEXPRESSION:
         case LISP_VALUE_SEXPRESSION:
             x->count = value->count;
-            x->cell = malloc(sizeof(lisp_value*) * value->count);
+            x->cell = lisp_allocate(sizeof(lisp_value*) * value->count);
             for (size_t i = 0; i < value->count; i += 1) {
-                x->cell[i] = lisp_value_copy(value->cell[i]);
+                x->cell[i] = lisp_value_retain(value->cell[i]);
             }
+            x->code = NULL;
             break;
     }
     return x;
 }
 
-lisp_environment* const lisp_environment_new() {
-    lisp_environment* environment = malloc(sizeof(lisp_environment));
-    environment->parent = NULL;
-    environment->count = 0;
-    environment->symbols = NULL;
-    environment->values = NULL;
-    return environment;
-}
+/* Return a value that can be changed in place, copying "value" if it is shared
+ * or lives in a heap we are not allocating from */
+lisp_value* lisp_value_unshare(lisp_value* const value) {
+    if (lisp_value_is_immediate(value)) {
+        return lisp_value_box(value);
+    }
+    if (value->references == 1 && lisp_heap_is_current(value)) {
+        /* Whatever changes it makes the compiled code stale */
+        if (value->type == LISP_VALUE_QEXPRESSION ||
+            value->type == LISP_VALUE_SEXPRESSION) {
+            lisp_code_free(value->code);
+            value->code = NULL;
+        }
+        return value;
+    }
+    lisp_value* x = lisp_value_copy(value);
+    lisp_value_delete(value);
+    return x;
+}
+
+/* Turn a Q-Expression into an S-Expression or back */
+lisp_value* lisp_value_retype(lisp_value* const value, const int type) {
+    if (value == LISP_VALUE_EMPTY_SEXPRESSION ||
+        value == LISP_VALUE_EMPTY_QEXPRESSION) {
+        return type == LISP_VALUE_SEXPRESSION ? LISP_VALUE_EMPTY_SEXPRESSION
+                                              : LISP_VALUE_EMPTY_QEXPRESSION;
+    }
+    lisp_value* x = lisp_value_unshare(value);
+    x->type = type;
+    return x;
+}
+
+/* "*part" is shared by a copy made in "heap" with the value it was copied
+ * from. If it lives in a heap that does not last as long, give the copy one of
+ * its own, whose parts are then seen to in turn. */
+void lisp_value_promote_part(lisp_heap* const heap, lisp_value** const part) {
+    lisp_value* value = *part;
+    if (lisp_value_is_immediate(value) || lisp_heap_holds(heap, value)) {
+        return;
+    }
+    *part = lisp_value_copy(value);
+    lisp_value_delete(value);
+    lisp_value_push_pending(*part);
+}
+
+/* Return a reference to "value" that may be stored in "heap", copying whatever
+ * parts of it live in a heap that does not last as long */
+lisp_value* lisp_value_promote(lisp_heap* const heap, lisp_value* const value) {
+    if (lisp_value_is_immediate(value) || lisp_heap_holds(heap, value)) {
+        return lisp_value_retain(value);
+    }
+    lisp_heap* previous = lisp_heap_enter(heap);
+    size_t base = lisp_value_pending.count;
+    lisp_value* x = lisp_value_copy(value);
+    lisp_value_push_pending(x);
+    while (lisp_value_pending.count > base) {
+        lisp_value* copy = lisp_value_pop_pending();
+        switch (copy->type) {
+            case LISP_VALUE_FUNCTION:
+                if (!lisp_value_is_builtin(copy)) {
+                    lisp_environment* environment = copy->environment;
+                    for (size_t i = 0; i < environment->count; i += 1) {
+                        lisp_value_promote_part(heap,
+                                                &environment->values[i]);
+                    }
+                    lisp_value_promote_part(heap, &copy->formals);
+                    lisp_value_promote_part(heap, &copy->body);
+                }
+                break;
+            case LISP_VALUE_QEXPRESSION:
+            case LISP_VALUE_SEXPRESSION:
+                for (size_t i = 0; i < copy->count; i += 1) {
+                    lisp_value_promote_part(heap, &copy->cell[i]);
+                }
+                break;
+        }
+    }
+    lisp_heap_enter(previous);
+    return x;
+}
+
+lisp_environment* const lisp_environment_new() {
+    lisp_environment* environment = lisp_allocate(sizeof(lisp_environment));
+    environment->parent = NULL;
+    environment->heap = lisp_heap_of(environment);
+    environment->count = 0;
+    environment->capacity = 0;
+    environment->symbols = NULL;
+    environment->values = NULL;
+    environment->index = NULL;
+    environment->index_capacity = 0;
+    environment->old_index = NULL;
+    environment->old_capacity = 0;
+    environment->old_count = 0;
+    environment->migrated = 0;
+    return environment;
+}
+
+/* Free the environment itself, but not the values it holds */
+void lisp_environment_free(lisp_environment* const environment) {
+    /* Do not delete environment->parent */
+    lisp_free(environment->symbols);
+    lisp_free(environment->values);
+    lisp_free(environment->index);
+    lisp_free(environment->old_index);
+    lisp_free(environment);
+}
 
 void lisp_environment_delete(lisp_environment* const environment) {
     for (size_t i = 0; i < environment->count; i += 1) {
-        free(environment->symbols[i]);
         lisp_value_delete(environment->values[i]);
     }
-    /* Do not delete environment->parent */
-    free(environment->symbols);
-    free(environment->values);
-    free(environment);
+    lisp_environment_free(environment);
+}
+
+/* Drop every binding but keep the space for them */
+void lisp_environment_clear(lisp_environment* const environment) {
+    for (size_t i = 0; i < environment->count; i += 1) {
+        lisp_value_delete(environment->values[i]);
+    }
+    environment->count = 0;
+    lisp_free(environment->index);
+    lisp_free(environment->old_index);
+    environment->index = NULL;
+    environment->index_capacity = 0;
+    environment->old_index = NULL;
+    environment->old_capacity = 0;
+    environment->old_count = 0;
+    environment->migrated = 0;
+}
+
+size_t lisp_environment_hash(const char* const symbol) {
+    /* Symbols are interned, so their address identifies them */
+    size_t hash = (size_t)((uintptr_t)symbol >> 4);
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du;
+    hash ^= hash >> 12;
+    return hash;
+}
+
+/* Slot + 1 of "symbol" in "index", or 0 if it is not there */
+size_t lisp_environment_probe(const lisp_environment* const environment,
+                              const size_t* const index,
+                              const size_t capacity, const char* const symbol) {
+    size_t mask = capacity - 1;
+    for (size_t i = lisp_environment_hash(symbol) & mask; index[i] != 0;
+         i = (i + 1) & mask) {
+        if (environment->symbols[index[i] - 1] == symbol) {
+            return index[i];
+        }
+    }
+    return 0;
+}
+
+void lisp_environment_index_insert(lisp_environment* const environment,
+                                   const size_t slot) {
+    size_t mask = environment->index_capacity - 1;
+    size_t i = lisp_environment_hash(environment->symbols[slot]) & mask;
+    while (environment->index[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    environment->index[i] = slot + 1;
+}
+
+size_t* lisp_environment_index_new(const size_t capacity) {
+    size_t* index = lisp_allocate(sizeof(size_t) * capacity);
+    memset(index, 0, sizeof(size_t) * capacity);
+    return index;
+}
+
+/* Move up to "limit" slots from the old index into the new one */
+void lisp_environment_migrate(lisp_environment* const environment,
+                              const size_t limit) {
+    for (size_t i = 0; i < limit && environment->old_index != NULL; i += 1) {
+        if (environment->migrated == environment->old_count) {
+            lisp_free(environment->old_index);
+            environment->old_index = NULL;
+            break;
+        }
+        lisp_environment_index_insert(environment, environment->migrated);
+        environment->migrated += 1;
+    }
+}
+
+/* Index every slot at once, for an environment that has none yet */
+void lisp_environment_build_index(lisp_environment* const environment) {
+    size_t capacity = 32;
+    while (capacity < environment->count * 2) {
+        capacity *= 2;
+    }
+    environment->index = lisp_environment_index_new(capacity);
+    environment->index_capacity = capacity;
+    for (size_t i = 0; i < environment->count; i += 1) {
+        lisp_environment_index_insert(environment, i);
+    }
+}
+
+/* Add the last slot to the index, growing it when it gets half full */
+void lisp_environment_index_last(lisp_environment* const environment) {
+    if (environment->count <= LISP_ENVIRONMENT_INDEX_MIN) {
+        return;
+    }
+    if (environment->index == NULL) {
+        lisp_environment_build_index(environment);
+        return;
+    }
+    lisp_environment_migrate(environment, LISP_ENVIRONMENT_MIGRATE);
+    lisp_environment_index_insert(environment, environment->count - 1);
+    if (environment->count * 2 <= environment->index_capacity) {
+        return;
+    }
+    /* The last resize is long finished by now, but make sure of it */
+    lisp_environment_migrate(environment, SIZE_MAX);
+    environment->old_index = environment->index;
+    environment->old_capacity = environment->index_capacity;
+    environment->old_count = environment->count;
+    environment->migrated = 0;
+    environment->index_capacity *= 2;
+    environment->index =
+        lisp_environment_index_new(environment->index_capacity);
+}
+
+/* Slot of "symbol" in "environment" itself, or its count if it is unbound */
+size_t lisp_environment_find(const lisp_environment* const environment,
+                             const char* const symbol) {
+    if (environment->index == NULL) {
+        for (size_t i = 0; i < environment->count; i += 1) {
+            if (environment->symbols[i] == symbol) {
+                return i;
+            }
+        }
+        return environment->count;
+    }
+    size_t slot = lisp_environment_probe(environment, environment->index,
+                                         environment->index_capacity, symbol);
+    if (slot == 0 && environment->old_index != NULL) {
+        slot = lisp_environment_probe(environment, environment->old_index,
+                                      environment->old_capacity, symbol);
+    }
+    return slot == 0 ? environment->count : slot - 1;
 }
 
 lisp_environment* lisp_environment_copy(
     const lisp_environment* const environment) {
-    lisp_environment* new_environment = malloc(sizeof(lisp_environment));
+    lisp_environment* new_environment = lisp_environment_new();
     new_environment->parent = environment->parent;
     new_environment->count = environment->count;
-    new_environment->symbols = malloc(sizeof(char*) * environment->count);
-    new_environment->values = malloc(sizeof(lisp_value*) * environment->count);
+    new_environment->capacity = environment->count;
+    new_environment->symbols =
+        lisp_allocate(sizeof(char*) * environment->count);
+    new_environment->values =
+        lisp_allocate(sizeof(lisp_value*) * environment->count);
     for (size_t i = 0; i < environment->count; i += 1) {
-        size_t symbol_length = strlen(environment->symbols[i]) + 1;
-        new_environment->symbols[i] = malloc(symbol_length);
-        strncpy(new_environment->symbols[i], environment->symbols[i],
-                symbol_length);
-        new_environment->values[i] = lisp_value_copy(environment->values[i]);
+        new_environment->symbols[i] = environment->symbols[i];
+        new_environment->values[i] = lisp_value_retain(environment->values[i]);
+    }
+    if (new_environment->count > LISP_ENVIRONMENT_INDEX_MIN) {
+        lisp_environment_build_index(new_environment);
     }
     return new_environment;
 }
 
+void lisp_gc_count_promoted(const size_t bytes);
+
+/* Store a reference to "value" in a slot of "environment" */
+lisp_value* lisp_environment_store(lisp_environment* const environment,
+                                   lisp_value* const value) {
+    lisp_heap* heap = environment->heap;
+    size_t bytes = lisp_heap_bytes(heap);
+    lisp_value* x = lisp_value_promote(heap, value);
+    lisp_gc_count_promoted(lisp_heap_bytes(heap) - bytes);
+    return x;
+}
+
 lisp_value* lisp_environment_get(const lisp_environment* const environment,
                                  const lisp_value* const key) {
-    for (size_t i = 0; i < environment->count; i += 1) {
-        if (strcmp(environment->symbols[i], key->symbol) == 0) {
-            return lisp_value_copy(environment->values[i]);
-        }
+    /* Try the slot the symbol was resolved to before searching by name */
+    if (key->slot < environment->count &&
+        environment->symbols[key->slot] == key->symbol) {
+        return lisp_value_retain(environment->values[key->slot]);
+    }
+    size_t slot = lisp_environment_find(environment, key->symbol);
+    if (slot < environment->count) {
+        return lisp_value_retain(environment->values[slot]);
     }
     if (environment->parent != NULL) {
         return lisp_environment_get(environment->parent, key);
@@ -264,30 +1210,34 @@ lisp_value* lisp_environment_get(const lisp_environment* const environment,
 
 void lisp_environment_put(lisp_environment* environment,
                           const lisp_value* const key,
-                          const lisp_value* const value) {
-    for (size_t i = 0; i < environment->count; i += 1) {
-        if (strcmp(environment->symbols[i], key->symbol) == 0) {
-            lisp_value_delete(environment->values[i]);
-            environment->values[i] = lisp_value_copy(value);
-            return;
-        }
+                          lisp_value* const value) {
+    /* What we store has to live as long as the environment does */
+    lisp_heap* previous = lisp_heap_enter(environment->heap);
+    size_t slot = lisp_environment_find(environment, key->symbol);
+    if (slot < environment->count) {
+        lisp_value* old = environment->values[slot];
+        environment->values[slot] = lisp_environment_store(environment, value);
+        lisp_value_delete(old);
+        lisp_heap_enter(previous);
+        return;
     }
-    size_t last = environment->count;
+    if (environment->count == environment->capacity) {
+        environment->capacity = environment->capacity * 2 + 2;
+        environment->values = lisp_reallocate(
+            environment->values, sizeof(lisp_value*) * environment->capacity);
+        environment->symbols = lisp_reallocate(
+            environment->symbols, sizeof(char*) * environment->capacity);
+    }
+    environment->values[slot] = lisp_environment_store(environment, value);
+    environment->symbols[slot] = key->symbol;
     environment->count += 1;
-    environment->values =
-        realloc(environment->values, sizeof(lisp_value*) * environment->count);
-    environment->symbols =
-        realloc(environment->symbols, sizeof(char*) * environment->count);
-
-    environment->values[last] = lisp_value_copy(value);
-    size_t symbol_length = strlen(key->symbol) + 1;
-    environment->symbols[last] = malloc(symbol_length);
-    strncpy(environment->symbols[last], key->symbol, symbol_length);
+    lisp_environment_index_last(environment);
+    lisp_heap_enter(previous);
 }
 
 void lisp_environment_def(lisp_environment* environment,
                           const lisp_value* const key,
-                          const lisp_value* const value) {
+                          lisp_value* const value) {
     /* Define in global environment */
     while (environment->parent != NULL) {
         environment = environment->parent;
@@ -295,6 +1245,314 @@ void lisp_environment_def(lisp_environment* environment,
     lisp_environment_put(environment, key, value);
 }
 
+/* Call frames. A call binds its arguments in a frame from this stack instead
+ * of in the function, so calling a function never changes it. Popped frames
+ * are kept for the next call. Their arrays come from the long-lived heap,
+ * since they outlive any one evaluation, but they only ever hold temporaries
+ * and are emptied when popped, so nothing is left pointing into the arena
+ * when it is dropped.
+ */
+#define LISP_FRAME_SLOTS 8
+
+lisp_environment** lisp_frames = NULL;
+size_t lisp_frame_count = 0;
+size_t lisp_frame_capacity = 0;
+
+lisp_environment* lisp_frame_push(lisp_environment* const parent) {
+    if (lisp_frame_count == lisp_frame_capacity) {
+        lisp_frame_capacity = lisp_frame_capacity * 2 + 16;
+        lisp_frames = realloc(lisp_frames, sizeof(lisp_environment*) *
+                                               lisp_frame_capacity);
+        lisp_heap* previous = lisp_heap_enter(lisp_heap_long_lived());
+        for (size_t i = lisp_frame_count; i < lisp_frame_capacity; i += 1) {
+            lisp_environment* frame = lisp_environment_new();
+            frame->heap = lisp_heap_arena();
+            frame->capacity = LISP_FRAME_SLOTS;
+            frame->symbols = lisp_allocate(sizeof(char*) * frame->capacity);
+            frame->values =
+                lisp_allocate(sizeof(lisp_value*) * frame->capacity);
+            lisp_frames[i] = frame;
+        }
+        lisp_heap_enter(previous);
+    }
+    lisp_environment* frame = lisp_frames[lisp_frame_count];
+    lisp_frame_count += 1;
+    frame->parent = parent;
+    return frame;
+}
+
+void lisp_frame_pop() {
+    lisp_frame_count -= 1;
+    lisp_environment* frame = lisp_frames[lisp_frame_count];
+    lisp_environment_clear(frame);
+    frame->parent = NULL;
+}
+
+/* Garbage collection. The evaluation arena is the young generation and the
+ * global heap the old one. Nothing old ever points into the arena (see
+ * lisp_value_promote), so a minor collection only has to promote what the
+ * roots still need before the arena is dropped. Reference counting frees most
+ * old values by itself; a major collection marks from the roots and sweeps
+ * whatever it missed. Collections only run between top-level evaluations,
+ * where every live value is reachable from the global environment or from a
+ * root pushed by the code driving the evaluation.
+ */
+typedef struct {
+    size_t minor_collections;
+    size_t major_collections;
+    size_t bytes_promoted;
+    size_t bytes_swept;
+    long pause_total; /* Microseconds */
+    long pause_max;
+} lisp_gc_statistics;
+
+lisp_gc_statistics lisp_gc_stats;
+lisp_environment* lisp_gc_environment = NULL;
+lisp_value*** lisp_gc_roots = NULL;
+size_t lisp_gc_root_count = 0;
+size_t lisp_gc_root_capacity = 0;
+size_t lisp_evaluation_depth = 0;
+
+void lisp_gc_push_root(lisp_value** const root) {
+    if (lisp_gc_root_count == lisp_gc_root_capacity) {
+        lisp_gc_root_capacity = lisp_gc_root_capacity * 2 + 8;
+        lisp_gc_roots = realloc(lisp_gc_roots,
+                                sizeof(lisp_value**) * lisp_gc_root_capacity);
+    }
+    lisp_gc_roots[lisp_gc_root_count] = root;
+    lisp_gc_root_count += 1;
+}
+
+void lisp_gc_pop_root() { lisp_gc_root_count -= 1; }
+
+/* Add a root for the rest of the run. It goes under the others, which are
+ * still popped in the order they were pushed. */
+void lisp_gc_keep_root(lisp_value** const root) {
+    lisp_gc_push_root(root);
+    memmove(lisp_gc_roots + 1, lisp_gc_roots,
+            sizeof(lisp_value**) * (lisp_gc_root_count - 1));
+    lisp_gc_roots[0] = root;
+}
+
+void lisp_gc_count_promoted(const size_t bytes) {
+    lisp_gc_stats.bytes_promoted += bytes;
+}
+
+#ifdef LISP_ALLOCATOR_MALLOC
+
+/* Without the slab heaps there is nothing to collect */
+void lisp_gc_request() {}
+
+void lisp_evaluation_begin() { lisp_evaluation_depth += 1; }
+
+void lisp_evaluation_end() { lisp_evaluation_depth -= 1; }
+
+#else
+
+#define LISP_GC_MINIMUM_THRESHOLD (1 << 20)
+
+size_t lisp_gc_threshold = LISP_GC_MINIMUM_THRESHOLD;
+bool lisp_gc_requested = false;
+
+long lisp_gc_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void lisp_gc_pause(const long start) {
+    long pause = lisp_gc_clock() - start;
+    lisp_gc_stats.pause_total += pause;
+    if (pause > lisp_gc_stats.pause_max) {
+        lisp_gc_stats.pause_max = pause;
+    }
+}
+
+/* Promote whatever the roots still need out of the arena, then drop it */
+void lisp_gc_minor() {
+    long start = lisp_gc_clock();
+    size_t bytes = lisp_heap_global.bytes;
+    lisp_heap_current = &lisp_heap_global;
+    for (size_t i = 0; i < lisp_gc_root_count; i += 1) {
+        lisp_value* value = *lisp_gc_roots[i];
+        if (value != NULL && !lisp_value_is_immediate(value) &&
+            !lisp_heap_holds(&lisp_heap_global, value)) {
+            *lisp_gc_roots[i] = lisp_value_promote(&lisp_heap_global, value);
+            lisp_value_delete(value);
+        }
+    }
+    lisp_heap_clear(&lisp_heap_evaluation);
+    lisp_gc_stats.bytes_promoted += lisp_heap_global.bytes - bytes;
+    lisp_gc_stats.minor_collections += 1;
+    lisp_gc_pause(start);
+}
+
+typedef struct {
+    lisp_value** values;
+    size_t count;
+    size_t capacity;
+} lisp_gc_mark_stack;
+
+void lisp_gc_mark_push(lisp_gc_mark_stack* const stack,
+                       lisp_value* const value) {
+    if (value == NULL || lisp_value_is_immediate(value) || value->marked) {
+        return;
+    }
+    value->marked = true;
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity * 2 + 64;
+        stack->values =
+            realloc(stack->values, sizeof(lisp_value*) * stack->capacity);
+    }
+    stack->values[stack->count] = value;
+    stack->count += 1;
+}
+
+void lisp_gc_mark_environment(lisp_gc_mark_stack* const stack,
+                              const lisp_environment* const environment) {
+    for (size_t i = 0; i < environment->count; i += 1) {
+        lisp_gc_mark_push(stack, environment->values[i]);
+    }
+}
+
+void lisp_gc_mark(lisp_gc_mark_stack* const stack) {
+    while (stack->count > 0) {
+        stack->count -= 1;
+        lisp_value* value = stack->values[stack->count];
+        switch (value->type) {
+            case LISP_VALUE_FUNCTION:
+                if (!lisp_value_is_builtin(value)) {
+                    lisp_gc_mark_environment(stack, value->environment);
+                    lisp_gc_mark_push(stack, value->formals);
+                    lisp_gc_mark_push(stack, value->body);
+                }
+                break;
+            case LISP_VALUE_QEXPRESSION:
+            case LISP_VALUE_SEXPRESSION:
+                for (size_t i = 0; i < value->count; i += 1) {
+                    lisp_gc_mark_push(stack, value->cell[i]);
+                }
+                break;
+        }
+    }
+}
+
+/* The value is unreachable: free what it owns and let the values it pointed
+ * at that survive know they lost a reference. Unmarked ones get swept on
+ * their own. */
+void lisp_gc_release(lisp_value* const value) {
+    if (!lisp_value_is_immediate(value) && value->marked) {
+        value->references -= 1;
+    }
+}
+
+void lisp_gc_sweep_value(lisp_value* const value) {
+    switch (value->type) {
+        case LISP_VALUE_FUNCTION:
+            if (!lisp_value_is_builtin(value)) {
+                lisp_environment* environment = value->environment;
+                for (size_t i = 0; i < environment->count; i += 1) {
+                    lisp_gc_release(environment->values[i]);
+                }
+                lisp_environment_free(environment);
+                lisp_gc_release(value->formals);
+                lisp_gc_release(value->body);
+            }
+            break;
+        case LISP_VALUE_STRING:
+        case LISP_VALUE_ERROR:
+            lisp_value_free_text(value);
+            break;
+        case LISP_VALUE_QEXPRESSION:
+        case LISP_VALUE_SEXPRESSION:
+            for (size_t i = 0; i < value->count; i += 1) {
+                lisp_gc_release(value->cell[i]);
+            }
+            lisp_free(value->cell);
+            lisp_code_free(value->code);
+            break;
+    }
+    lisp_free(value);
+}
+
+void lisp_gc_major() {
+    long start = lisp_gc_clock();
+    lisp_gc_mark_stack stack = {NULL, 0, 0};
+    if (lisp_gc_environment != NULL) {
+        lisp_gc_mark_environment(&stack, lisp_gc_environment);
+    }
+    for (size_t i = 0; i < lisp_gc_root_count; i += 1) {
+        lisp_gc_mark_push(&stack, *lisp_gc_roots[i]);
+    }
+    lisp_gc_mark(&stack);
+    free(stack.values);
+
+    size_t bytes = lisp_heap_global.bytes;
+    size_t block_size = lisp_heap_block_sizes[LISP_HEAP_VALUES];
+    for (lisp_heap_page* page = lisp_heap_global.pages; page != NULL;
+         page = page->next) {
+        if (page->size_class != LISP_HEAP_VALUES) {
+            continue;
+        }
+        char* block = (char*)page + LISP_HEAP_HEADER_SIZE;
+        char* end = (char*)page + LISP_HEAP_PAGE_SIZE - block_size;
+        for (; block <= end; block += block_size) {
+            lisp_value* value = (lisp_value*)block;
+            if (value->references == 0) {
+                continue;
+            }
+            if (!value->marked) {
+                lisp_gc_sweep_value(value);
+            }
+        }
+    }
+    /* Clear marks only once everything unreachable is gone, so that sweeping
+     * can tell the survivors apart */
+    for (lisp_heap_page* page = lisp_heap_global.pages; page != NULL;
+         page = page->next) {
+        if (page->size_class != LISP_HEAP_VALUES) {
+            continue;
+        }
+        char* block = (char*)page + LISP_HEAP_HEADER_SIZE;
+        char* end = (char*)page + LISP_HEAP_PAGE_SIZE - block_size;
+        for (; block <= end; block += block_size) {
+            ((lisp_value*)block)->marked = false;
+        }
+    }
+    lisp_gc_stats.bytes_swept += bytes - lisp_heap_global.bytes;
+    lisp_gc_stats.major_collections += 1;
+    lisp_gc_threshold = lisp_heap_global.bytes * 2;
+    if (lisp_gc_threshold < LISP_GC_MINIMUM_THRESHOLD) {
+        lisp_gc_threshold = LISP_GC_MINIMUM_THRESHOLD;
+    }
+    lisp_gc_requested = false;
+    lisp_gc_pause(start);
+}
+
+/* Run a major collection once the current top-level evaluation is done */
+void lisp_gc_request() { lisp_gc_requested = true; }
+
+/* Evaluations nest; only the outermost one owns the arena */
+void lisp_evaluation_begin() {
+    if (lisp_evaluation_depth == 0) {
+        lisp_heap_current = &lisp_heap_evaluation;
+    }
+    lisp_evaluation_depth += 1;
+}
+
+void lisp_evaluation_end() {
+    lisp_evaluation_depth -= 1;
+    if (lisp_evaluation_depth > 0) {
+        return;
+    }
+    lisp_gc_minor();
+    if (lisp_gc_requested || lisp_heap_global.bytes > lisp_gc_threshold) {
+        lisp_gc_major();
+    }
+}
+
+#endif
+
 const char* lisp_type_name(const int type) {
     switch (type) {
         case LISP_VALUE_FUNCTION:
@@ -318,9 +1576,9 @@ const char* lisp_type_name(const int type) {
 
 lisp_value* lisp_value_lambda(lisp_value* const formals,
                               lisp_value* const body) {
-    lisp_value* value = malloc(sizeof(lisp_value));
+    lisp_value* value = lisp_value_allocate();
     value->type = LISP_VALUE_FUNCTION;
-    value->builtin = NULL;
+    value->references = 1;
     value->environment = lisp_environment_new();
     value->formals = formals;
     value->body = body;
@@ -346,13 +1604,16 @@ lisp_value* lisp_value_read_string(const mpc_ast_t* t) {
 }
 
 lisp_value* lisp_value_add(lisp_value* value, lisp_value* const x) {
+    value = lisp_value_unshare(value);
     value->count += 1;
-    value->cell = realloc(value->cell, sizeof(lisp_value*) * value->count);
+    value->cell =
+        lisp_reallocate(value->cell, sizeof(lisp_value*) * value->count);
     value->cell[value->count - 1] = x;
     return value;
 }
 
-lisp_value* lisp_value_read(const mpc_ast_t* const t) {
+/* Read a number, string or symbol, or return NULL for anything else */
+lisp_value* lisp_value_read_atom(const mpc_ast_t* const t) {
     if (strstr(t->tag, "number")) {
         return lisp_value_read_number(t);
     }
@@ -362,7 +1623,11 @@ lisp_value* lisp_value_read(const mpc_ast_t* const t) {
     if (strstr(t->tag, "symbol")) {
         return lisp_value_symbol(t->contents);
     }
+    return NULL;
+}
 
+/* The empty expression that the children of "t" are read into */
+lisp_value* lisp_value_read_expression(const mpc_ast_t* const t) {
     lisp_value* x = NULL;
     if (strcmp(t->tag, ">") == 0) {
         x = lisp_value_sexpression();
@@ -371,764 +1636,5091 @@ lisp_value* lisp_value_read(const mpc_ast_t* const t) {
     } else if (strstr(t->tag, "sexpression")) {
         x = lisp_value_sexpression();
     }
+    return x;
+}
+
+bool lisp_value_read_skips(const mpc_ast_t* const t) {
+    if (strcmp(t->contents, "(") == 0) {
+        return true;
+    }
+    if (strcmp(t->contents, ")") == 0) {
+        return true;
+    }
+    if (strcmp(t->contents, "}") == 0) {
+        return true;
+    }
+    if (strcmp(t->contents, "{") == 0) {
+        return true;
+    }
+    if (strcmp(t->tag, "regex") == 0) {
+        return true;
+    }
+    if (strstr(t->tag, "comment")) {
+        return true;
+    }
+    return false;
+}
 
-    for (size_t i = 0; i < t->children_num; i += 1) {
-        if (strcmp(t->children[i]->contents, "(") == 0) {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, ")") == 0) {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, "}") == 0) {
+/* An expression being read, and the next of its children to read */
+typedef struct {
+    const mpc_ast_t* ast;
+    lisp_value* value;
+    int index;
+} lisp_read_frame;
+
+/* Nested expressions are kept on a stack of our own rather than read
+ * recursively, so that deeply nested input cannot overflow the C stack */
+lisp_value* lisp_value_read(const mpc_ast_t* const t) {
+    lisp_value* atom = lisp_value_read_atom(t);
+    if (atom != NULL) {
+        return atom;
+    }
+
+    size_t capacity = 16;
+    size_t count = 1;
+    lisp_read_frame* stack = malloc(sizeof(lisp_read_frame) * capacity);
+    stack[0].ast = t;
+    stack[0].value = lisp_value_read_expression(t);
+    stack[0].index = 0;
+    for (;;) {
+        lisp_read_frame* top = &stack[count - 1];
+        if (top->index == top->ast->children_num) {
+            lisp_value* x = top->value;
+            count -= 1;
+            if (count == 0) {
+                free(stack);
+                return x;
+            }
+            stack[count - 1].value = lisp_value_add(stack[count - 1].value, x);
             continue;
         }
-        if (strcmp(t->children[i]->contents, "{") == 0) {
+        const mpc_ast_t* child = top->ast->children[top->index];
+        top->index += 1;
+        if (lisp_value_read_skips(child)) {
             continue;
         }
-        if (strcmp(t->children[i]->tag, "regex") == 0) {
+        atom = lisp_value_read_atom(child);
+        if (atom != NULL) {
+            top->value = lisp_value_add(top->value, atom);
             continue;
         }
-        if (strstr(t->children[i]->tag, "comment")) {
-            continue;
+        if (count == capacity) {
+            capacity *= 2;
+            stack = realloc(stack, sizeof(lisp_read_frame) * capacity);
         }
-        x = lisp_value_add(x, lisp_value_read(t->children[i]));
+        stack[count].ast = child;
+        stack[count].value = lisp_value_read_expression(child);
+        stack[count].index = 0;
+        count += 1;
     }
-    return x;
 }
 
-void lisp_value_print_string(const lisp_value* const value) {
-    size_t size = strlen(value->string) + 1;
-    char* escaped_string = malloc(size);
-    strncpy(escaped_string, value->string, size);
-    escaped_string = mpcf_escape(escaped_string);
-    printf("\"%s\"", escaped_string);
-    free(escaped_string);
+/* The reader. It goes over the text once, building values as it finds them
+ * with nothing in between: symbols are interned and strings unescaped
+ * straight from the text. Open expressions are kept on a stack of our own,
+ * with the values read into them so far on another, so that deeply nested
+ * input cannot overflow the C stack. With --mpc-reader, text is read with
+ * the mpc grammar instead. */
+enum {
+    LISP_READ_INVALID,
+    LISP_READ_SPACE,
+    LISP_READ_SYMBOL, /* Any character a symbol may have but a digit */
+    LISP_READ_DIGIT
+};
+
+unsigned char lisp_read_classes[256];
+
+bool lisp_reader_mpc = false;
+
+void lisp_read_classify() {
+    if (lisp_read_classes[(unsigned char)'0'] == LISP_READ_DIGIT) {
+        return;
+    }
+    const char* spaces = " \t\n\v\f\r";
+    const char* symbols = "_+-*/\\=<>!&";
+    for (int c = 0; c < 256; c += 1) {
+        if (c >= '0' && c <= '9') {
+            lisp_read_classes[c] = LISP_READ_DIGIT;
+        } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                   (c != '\0' && strchr(symbols, c) != NULL)) {
+            lisp_read_classes[c] = LISP_READ_SYMBOL;
+        } else if (c != '\0' && strchr(spaces, c) != NULL) {
+            lisp_read_classes[c] = LISP_READ_SPACE;
+        } else {
+            lisp_read_classes[c] = LISP_READ_INVALID;
+        }
+    }
 }
 
-void lisp_value_print(const lisp_value* const value);
+/* Finding where tokens end. Like the first stage of simdjson, the text is
+ * classified a block of 64 bytes at a time into bitmaps of the bytes of each
+ * kind, and the reader then skips a run of spaces, a symbol or the inside of
+ * a string or comment by finding the next bit set in a bitmap. A block is
+ * classified with AVX2 or SSE2 where the processor has it, and one byte at a
+ * time elsewhere, or with --no-simd. */
+enum {
+    LISP_SCAN_SPACE,
+    LISP_SCAN_WORD, /* A character of a symbol or number */
+    LISP_SCAN_QUOTE, /* '"' or '\' */
+    LISP_SCAN_NEWLINE,
+    LISP_SCAN_SYNTAX, /* Neither of the first two, worked out from them */
+    LISP_SCAN_MASKS
+};
+
+typedef void (*lisp_scan_function)(const char* block, uint64_t* masks);
 
-void lisp_value_expression_print(const lisp_value* const value, char open,
-                                 char close) {
-    putchar(open);
-    for (size_t i = 0; i < value->count; i += 1) {
-        lisp_value_print(value->cell[i]);
-        if (i != (value->count - 1)) {
-            putchar(' ');
+void lisp_scan_scalar(const char* const block, uint64_t* const masks) {
+    for (int k = 0; k < LISP_SCAN_MASKS; k += 1) {
+        masks[k] = 0;
+    }
+    for (int i = 0; i < 64; i += 1) {
+        unsigned char c = block[i];
+        uint64_t bit = (uint64_t)1 << i;
+        int class = lisp_read_classes[c];
+        if (class == LISP_READ_SPACE) {
+            masks[LISP_SCAN_SPACE] |= bit;
+        } else if (class >= LISP_READ_SYMBOL) {
+            masks[LISP_SCAN_WORD] |= bit;
+        }
+        if (c == '"' || c == '\\') {
+            masks[LISP_SCAN_QUOTE] |= bit;
+        }
+        if (c == '\n' || c == '\r') {
+            masks[LISP_SCAN_NEWLINE] |= bit;
         }
     }
-    putchar(close);
 }
 
-void lisp_value_print(const lisp_value* const value) {
-    switch (value->type) {
-        case LISP_VALUE_NUMBER:
-            printf("%li", value->number);
-            break;
-        case LISP_VALUE_STRING:
-            lisp_value_print_string(value);
-            break;
-        case LISP_VALUE_FUNCTION:
-            if (value->builtin != NULL) {
-                printf("<builtin>");
-            } else {
-                printf("(\\ ");
-                lisp_value_print(value->formals);
-                putchar(' ');
-                lisp_value_print(value->body);
-                putchar(')');
-            }
-            break;
-        case LISP_VALUE_ERROR:
-            printf("Error: %s", value->error);
-            break;
-        case LISP_VALUE_SYMBOL:
-            printf("%s", value->symbol);
-            break;
-        case LISP_VALUE_QEXPRESSION:
-            lisp_value_expression_print(value, '{', '}');
-            break;
-        case LISP_VALUE_SEXPRESSION:
-            lisp_value_expression_print(value, '(', ')');
-            break;
+#ifdef LISP_SCAN_SIMD
+
+/* Whether the bytes of "v" are in the range "low" to "high". Bytes from 128
+ * up compare as negative, and so are in no range used here. */
+#define LISP_SCAN_RANGE(cmpgt, and, set1, v, low, high) \
+    and(cmpgt(v, set1((low) - 1)), cmpgt(set1((high) + 1), v))
+
+void lisp_scan_sse2(const char* const block, uint64_t* const masks) {
+    for (int k = 0; k < LISP_SCAN_MASKS; k += 1) {
+        masks[k] = 0;
+    }
+    for (int i = 0; i < 64; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + i));
+        __m128i space = _mm_or_si128(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+            LISP_SCAN_RANGE(_mm_cmpgt_epi8, _mm_and_si128, _mm_set1_epi8, v,
+                            '\t', '\r'));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i word = _mm_or_si128(
+            LISP_SCAN_RANGE(_mm_cmpgt_epi8, _mm_and_si128, _mm_set1_epi8,
+                            lower, 'a', 'z'),
+            LISP_SCAN_RANGE(_mm_cmpgt_epi8, _mm_and_si128, _mm_set1_epi8, v,
+                            '0', '9'));
+        for (const char* s = "_+-*/\\=<>!&"; *s != '\0'; s += 1) {
+            word = _mm_or_si128(word, _mm_cmpeq_epi8(v, _mm_set1_epi8(*s)));
+        }
+        __m128i quote = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        __m128i newline =
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        masks[LISP_SCAN_SPACE] |=
+            (uint64_t)(uint16_t)_mm_movemask_epi8(space) << i;
+        masks[LISP_SCAN_WORD] |= (uint64_t)(uint16_t)_mm_movemask_epi8(word)
+                                 << i;
+        masks[LISP_SCAN_QUOTE] |=
+            (uint64_t)(uint16_t)_mm_movemask_epi8(quote) << i;
+        masks[LISP_SCAN_NEWLINE] |=
+            (uint64_t)(uint16_t)_mm_movemask_epi8(newline) << i;
     }
 }
 
-void lisp_value_println(const lisp_value* const value) {
-    lisp_value_print(value);
-    putchar('\n');
+__attribute__((target("avx2"))) void lisp_scan_avx2(
+    const char* const block, uint64_t* const masks) {
+    for (int k = 0; k < LISP_SCAN_MASKS; k += 1) {
+        masks[k] = 0;
+    }
+    for (int i = 0; i < 64; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(block + i));
+        __m256i space = _mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+            LISP_SCAN_RANGE(_mm256_cmpgt_epi8, _mm256_and_si256,
+                            _mm256_set1_epi8, v, '\t', '\r'));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i word = _mm256_or_si256(
+            LISP_SCAN_RANGE(_mm256_cmpgt_epi8, _mm256_and_si256,
+                            _mm256_set1_epi8, lower, 'a', 'z'),
+            LISP_SCAN_RANGE(_mm256_cmpgt_epi8, _mm256_and_si256,
+                            _mm256_set1_epi8, v, '0', '9'));
+        for (const char* s = "_+-*/\\=<>!&"; *s != '\0'; s += 1) {
+            word = _mm256_or_si256(word,
+                                   _mm256_cmpeq_epi8(v, _mm256_set1_epi8(*s)));
+        }
+        __m256i quote =
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        __m256i newline =
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        masks[LISP_SCAN_SPACE] |=
+            (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << i;
+        masks[LISP_SCAN_WORD] |=
+            (uint64_t)(uint32_t)_mm256_movemask_epi8(word) << i;
+        masks[LISP_SCAN_QUOTE] |=
+            (uint64_t)(uint32_t)_mm256_movemask_epi8(quote) << i;
+        masks[LISP_SCAN_NEWLINE] |=
+            (uint64_t)(uint32_t)_mm256_movemask_epi8(newline) << i;
+    }
 }
 
-lisp_value* lisp_value_pop(lisp_value* const value, size_t i) {
-    lisp_value* x = value->cell[i];
+#endif
 
-    /* Shift memory after the item at "i" over the top */
-    memmove(&value->cell[i], &value->cell[i + 1],
-            sizeof(lisp_value*) * (value->count - i - 1));
-
-    value->count -= 1;
+bool lisp_scan_simd = true;
+lisp_scan_function lisp_scan_block = NULL;
+const char* lisp_scan_name = NULL;
 
-    /* Reallocate the memory used */
-    value->cell = realloc(value->cell, sizeof(lisp_value*) * value->count);
-    return x;
+void lisp_scan_select() {
+    if (lisp_scan_block != NULL) {
+        return;
+    }
+    lisp_scan_block = lisp_scan_scalar;
+    lisp_scan_name = "scalar";
+#ifdef LISP_SCAN_SIMD
+    if (lisp_scan_simd) {
+        /* Asks cpuid what the processor supports */
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            lisp_scan_block = lisp_scan_avx2;
+            lisp_scan_name = "AVX2";
+        } else {
+            lisp_scan_block = lisp_scan_sse2;
+            lisp_scan_name = "SSE2";
+        }
+    }
+#endif
 }
 
-lisp_value* lisp_value_take(lisp_value* const value, size_t i) {
-    lisp_value* x = lisp_value_pop(value, i);
-    lisp_value_delete(value);
-    return x;
+size_t lisp_scan_first_bit(const uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    size_t i = 0;
+    while ((bits >> i & 1) == 0) {
+        i += 1;
+    }
+    return i;
+#endif
 }
 
-lisp_value* builtin_head(lisp_environment* const environment,
-                         lisp_value* const arguments) {
-    if (arguments->count > 1) {
-        lisp_value* error = lisp_value_error(
-            "Function 'head' passed too many arguments. Expected 1. Got %li.",
-            arguments->count);
-        lisp_value_delete(arguments);
-        return error;
+/* The text being read, and the bitmaps of the block last classified */
+typedef struct {
+    const char* text;
+    size_t length;
+    size_t block; /* Where the block starts */
+    uint64_t masks[LISP_SCAN_MASKS];
+} lisp_scanner;
+
+void lisp_scanner_load(lisp_scanner* const scanner, const size_t block) {
+    scanner->block = block;
+    if (block + 64 <= scanner->length) {
+        lisp_scan_block(scanner->text + block, scanner->masks);
+    } else {
+        /* The last block is padded with NULs, which are of no kind */
+        char padded[64] = {0};
+        memcpy(padded, scanner->text + block, scanner->length - block);
+        lisp_scan_block(padded, scanner->masks);
     }
-    if (arguments->cell[0]->type != LISP_VALUE_QEXPRESSION) {
-        lisp_value* error = lisp_value_error(
-            "Function 'head' passed an incorrect type '%s'. Expected "
-            "Q-Expression.",
-            lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
+    scanner->masks[LISP_SCAN_SYNTAX] =
+        ~(scanner->masks[LISP_SCAN_SPACE] | scanner->masks[LISP_SCAN_WORD]);
+}
+
+/* The first offset from "i" on whose byte is of "kind", or with "in" false,
+ * is not. The end of the text if there is none. */
+size_t lisp_scan(lisp_scanner* const scanner, size_t i, const int kind,
+                 const bool in) {
+    while (i < scanner->length) {
+        size_t block = i & ~(size_t)63;
+        if (block != scanner->block) {
+            lisp_scanner_load(scanner, block);
+        }
+        uint64_t bits = in ? scanner->masks[kind] : ~scanner->masks[kind];
+        bits >>= i - block;
+        if (bits != 0) {
+            i += lisp_scan_first_bit(bits);
+            return i < scanner->length ? i : scanner->length;
+        }
+        i = block + 64;
     }
-    if (arguments->cell[0]->count == 0) {
-        lisp_value_delete(arguments);
-        return lisp_value_error("Function 'head' passed {}.");
+    return scanner->length;
+}
+
+/* An expression being read: where its values start on the value stack, and
+ * where it was opened */
+typedef struct {
+    size_t first;
+    size_t offset;
+    char open;
+} lisp_read_open;
+
+/* Reads the forms of a text one at a time, so that each can be evaluated
+ * and freed before the next is read */
+typedef struct {
+    const char* name;
+    const char* text;
+    size_t length;
+    size_t offset; /* Where the next form is looked for */
+    size_t form;   /* Where the form read last starts */
+    size_t line;   /* The line at "line_offset", counted as needed */
+    size_t line_offset;
+    lisp_value* error; /* Why reading stopped, if it did not reach the end */
+    char** symbols;    /* The cache to intern through, if reading on threads */
+    lisp_scanner scanner;
+    lisp_value** values;
+    size_t value_count;
+    size_t value_capacity;
+    lisp_read_open* opens;
+    size_t open_count;
+    size_t open_capacity;
+} lisp_reader;
+
+void lisp_reader_init(lisp_reader* const reader, const char* const name,
+                      const char* const text, const size_t length) {
+    lisp_read_classify();
+    lisp_scan_select();
+    reader->name = name;
+    reader->text = text;
+    reader->length = length;
+    reader->offset = 0;
+    reader->form = 0;
+    reader->line = 1;
+    reader->line_offset = 0;
+    reader->error = NULL;
+    reader->symbols = NULL;
+    reader->scanner.text = text;
+    reader->scanner.length = length;
+    reader->scanner.block = SIZE_MAX;
+    reader->values = NULL;
+    reader->value_count = 0;
+    reader->value_capacity = 0;
+    reader->opens = NULL;
+    reader->open_count = 0;
+    reader->open_capacity = 0;
+}
+
+void lisp_reader_free(lisp_reader* const reader) {
+    while (reader->value_count > 0) {
+        reader->value_count -= 1;
+        lisp_value_delete(reader->values[reader->value_count]);
     }
-    lisp_value* value = lisp_value_take(arguments, 0);
-    while (value->count > 1) {
-        lisp_value_delete(lisp_value_pop(value, 1));
+    if (reader->error != NULL) {
+        lisp_value_delete(reader->error);
     }
-    return value;
+    free(reader->values);
+    free(reader->opens);
 }
 
-lisp_value* builtin_tail(lisp_environment* const environment,
-                         lisp_value* const arguments) {
-    if (arguments->count > 1) {
-        lisp_value* error = lisp_value_error(
-            "Function 'tail' passed too many arguments. Expected 1. Got %li.",
-            arguments->count);
-        lisp_value_delete(arguments);
-        return error;
+/* The line "offset" is on. Counting goes on from the last line asked for, so
+ * asking in order costs one pass over the text. */
+size_t lisp_reader_line(lisp_reader* const reader, const size_t offset) {
+    if (offset < reader->line_offset) {
+        reader->line = 1;
+        reader->line_offset = 0;
     }
-    if (arguments->cell[0]->type != LISP_VALUE_QEXPRESSION) {
-        lisp_value* error = lisp_value_error(
-            "Function 'tail' passed an incorrect type '%s'. Expected "
-            "Q-Expression.",
-            lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
+    const char* i = reader->text + reader->line_offset;
+    const char* end = reader->text + offset;
+    while ((i = memchr(i, '\n', end - i)) != NULL) {
+        reader->line += 1;
+        i += 1;
     }
-    if (arguments->cell[0]->count == 0) {
-        lisp_value_delete(arguments);
-        return lisp_value_error("Function 'tail' passed {}.");
+    reader->line_offset = offset;
+    return reader->line;
+}
+
+void lisp_reader_push(lisp_reader* const reader, lisp_value* const value) {
+    if (reader->value_count == reader->value_capacity) {
+        reader->value_capacity = reader->value_capacity * 2 + 64;
+        reader->values = realloc(reader->values, sizeof(lisp_value*) *
+                                                     reader->value_capacity);
     }
-    lisp_value* value = lisp_value_take(arguments, 0);
-    lisp_value_delete(lisp_value_pop(value, 0));
-    return value;
+    reader->values[reader->value_count] = value;
+    reader->value_count += 1;
 }
 
-lisp_value* builtin_list(lisp_environment* const environment,
-                         lisp_value* const arguments) {
-    arguments->type = LISP_VALUE_QEXPRESSION;
-    return arguments;
+/* An expression of "type" holding the "count" values at "cells" */
+lisp_value* lisp_read_expression(lisp_value* const* const cells,
+                                 const size_t count, const int type) {
+    if (count == 0) {
+        return type == LISP_VALUE_QEXPRESSION ? lisp_value_qexpression()
+                                              : lisp_value_sexpression();
+    }
+    lisp_value* x = lisp_value_allocate();
+    x->type = type;
+    x->references = 1;
+    x->count = count;
+    x->cell = lisp_allocate(sizeof(lisp_value*) * count);
+    x->code = NULL;
+    memcpy(x->cell, cells, sizeof(lisp_value*) * count);
+    return x;
 }
 
-lisp_value* lisp_value_evaluate(lisp_environment* const environment,
-                                lisp_value* const value);
+/* Pop the values read since "first" into one expression of "type" */
+lisp_value* lisp_reader_collect(lisp_reader* const reader, const size_t first,
+                                const int type) {
+    lisp_value* x = lisp_read_expression(
+        &reader->values[first], reader->value_count - first, type);
+    reader->value_count = first;
+    return x;
+}
 
-lisp_value* builtin_eval(lisp_environment* const environment,
-                         lisp_value* const arguments) {
-    if (arguments->count > 1) {
-        lisp_value* error = lisp_value_error(
-            "Function 'eval' passed too many arguments. Expected 1. Got %li.",
-            arguments->count);
-        lisp_value_delete(arguments);
-        return error;
+/* Give up at "offset", saying where that is. Returns NULL, as
+ * lisp_reader_next does when it stops. */
+lisp_value* lisp_reader_fail(lisp_reader* const reader, const size_t offset,
+                             const char* const message) {
+    size_t line = lisp_reader_line(reader, offset);
+    size_t column = 1;
+    while (column <= offset && reader->text[offset - column] != '\n') {
+        column += 1;
     }
-    if (arguments->cell[0]->type != LISP_VALUE_QEXPRESSION) {
-        lisp_value* error = lisp_value_error(
-            "Function 'eval' passed incorrect type '%s'. Expected "
-            "Q-Expression.",
-            lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
+    while (reader->value_count > 0) {
+        reader->value_count -= 1;
+        lisp_value_delete(reader->values[reader->value_count]);
     }
-    lisp_value* x = lisp_value_take(arguments, 0);
-    x->type = LISP_VALUE_SEXPRESSION;
-    return lisp_value_evaluate(environment, x);
+    reader->open_count = 0;
+    reader->offset = reader->length;
+    reader->error = lisp_value_error("%s:%zu:%zu: error: %s", reader->name,
+                                     line, column, message);
+    return NULL;
 }
 
-lisp_value* builtin_join(lisp_environment* const environment,
-                         lisp_value* const arguments) {
-    for (size_t i = 0; i < arguments->count; i += 1) {
-        if (arguments->cell[i]->type != LISP_VALUE_QEXPRESSION) {
-            lisp_value* error = lisp_value_error(
-                "Function 'join' passed incorrect type '%s'. Expected "
-                "Q-Expression.",
-                lisp_type_name(arguments->cell[i]->type));
-            lisp_value_delete(arguments);
-            return error;
+/* A number of digits from "start", with a '-' in front if "negative" */
+lisp_value* lisp_read_number(const char* const start, const size_t length,
+                             const bool negative) {
+    /* Accumulate downwards, as LONG_MIN has no positive counterpart */
+    long x = 0;
+    for (size_t i = 0; i < length; i += 1) {
+        int digit = start[i] - '0';
+        if (x < (LONG_MIN + digit) / 10) {
+            return lisp_value_error("Invalid number.");
         }
+        x = x * 10 - digit;
     }
-    lisp_value* x = lisp_value_pop(arguments, 0);
-    while (arguments->count > 0) {
-        lisp_value* y = lisp_value_pop(arguments, 0);
-        for (size_t i = 0; i < y->count; i += 1) {
-            x = lisp_value_add(x, y->cell[i]);
+    if (!negative) {
+        if (x == LONG_MIN) {
+            return lisp_value_error("Invalid number.");
         }
-        /* We don't want to get rid off the y->cell[i]'s, so we cannot call
-         * lisp_value_delete(y)
-         */
-        free(y->cell);
-        free(y);
+        x = -x;
     }
-    lisp_value_delete(arguments);
-    return x;
+    return lisp_value_number(x);
 }
 
-lisp_value* builtin_op(lisp_environment* const environment,
-                       lisp_value* const arguments, const char* const op) {
-    for (size_t i = 0; i < arguments->count; i += 1) {
-        if (arguments->cell[i]->type != LISP_VALUE_NUMBER) {
-            lisp_value* error =
-                lisp_value_error("Cannot operate on '%s'. Expected Number.",
-                                 lisp_type_name(arguments->cell[i]->type));
-            lisp_value_delete(arguments);
-            return error;
-        }
+/* The escapes mpcf_unescape knows. Any other backslash is kept. */
+char lisp_read_escape(const char c) {
+    switch (c) {
+        case 'a':
+            return '\a';
+        case 'b':
+            return '\b';
+        case 'f':
+            return '\f';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        case 't':
+            return '\t';
+        case 'v':
+            return '\v';
+        case '\\':
+        case '\'':
+        case '"':
+            return c;
+        case '0':
+            return '\0';
+        default:
+            return 'x'; /* Not an escape */
     }
+}
 
-    lisp_value* x = lisp_value_pop(arguments, 0);
+/* A string whose contents, still escaped, are the "length" characters at
+ * "start" */
+lisp_value* lisp_read_string(const char* const start, const size_t length) {
+    if (memchr(start, '\\', length) == NULL) {
+        lisp_value* x = lisp_value_allocate();
+        x->type = LISP_VALUE_STRING;
+        x->references = 1;
+        x->string = lisp_value_text(x, length + 1);
+        memcpy(x->string, start, length);
+        x->string[length] = '\0';
+        return x;
+    }
+    size_t size = 1;
+    for (size_t i = 0; i < length; i += 1) {
+        if (start[i] == '\\' && lisp_read_escape(start[i + 1]) != 'x') {
+            i += 1;
+        }
+        size += 1;
+    }
+    lisp_value* x = lisp_value_allocate();
+    x->type = LISP_VALUE_STRING;
+    x->references = 1;
+    x->string = lisp_value_text(x, size);
+    char* out = x->string;
+    for (size_t i = 0; i < length; i += 1) {
+        char c = start[i];
+        if (c == '\\' && lisp_read_escape(start[i + 1]) != 'x') {
+            i += 1;
+            c = lisp_read_escape(start[i]);
+        }
+        *out = c;
+        out += 1;
+    }
+    *out = '\0';
+    return x;
+}
 
-    if ((strcmp(op, "-") == 0) && arguments->count == 0) {
-        x->number = -x->number;
+lisp_value* lisp_reader_symbol(lisp_reader* const reader,
+                               const char* const name, const size_t length) {
+#ifdef LISP_READ_THREADS
+    if (reader->symbols != NULL) {
+        return lisp_value_symbol_interned(
+            lisp_symbol_intern_shared(reader->symbols, name, length));
     }
+#endif
+    return lisp_value_symbol_text(name, length);
+}
 
-    while (arguments->count > 0) {
-        lisp_value* y = lisp_value_pop(arguments, 0);
-        if (strcmp(op, "+") == 0) {
-            x->number += y->number;
+/* Read the next top-level form, or return NULL once there are no more. If
+ * reading stopped short, "error" says where the text went wrong. */
+lisp_value* lisp_reader_next(lisp_reader* const reader) {
+    const char* const text = reader->text;
+    const size_t length = reader->length;
+    /* The scanner is kept here while reading, where it can stay in
+     * registers */
+    lisp_scanner scanner = reader->scanner;
+    size_t i = reader->offset;
+    for (;;) {
+        if (reader->open_count == 0 && reader->value_count > 0) {
+            reader->value_count = 0;
+            reader->offset = i;
+            reader->scanner = scanner;
+            return reader->values[0];
         }
-        if (strcmp(op, "-") == 0) {
-            x->number -= y->number;
+        if (i == length) {
+            reader->offset = i;
+            if (reader->open_count > 0) {
+                lisp_read_open* open = &reader->opens[reader->open_count - 1];
+                return lisp_reader_fail(reader, open->offset,
+                                        open->open == '('
+                                            ? "'(' is never closed"
+                                            : "'{' is never closed");
+            }
+            return NULL;
         }
-        if (strcmp(op, "*") == 0) {
-            x->number *= y->number;
+        size_t start = i;
+        if (reader->open_count == 0) {
+            reader->form = start;
         }
-        if (strcmp(op, "/") == 0) {
-            if (y->number == 0) {
-                lisp_value_delete(x);
-                lisp_value_delete(y);
-                x = lisp_value_error("Division by zero.");
-                break;
+        char c = text[i];
+        int class = lisp_read_classes[(unsigned char)c];
+        if (class == LISP_READ_SPACE) {
+            i = lisp_scan(&scanner, i, LISP_SCAN_SPACE, false);
+        } else if (class == LISP_READ_DIGIT ||
+                   (c == '-' && i + 1 < length &&
+                    lisp_read_classes[(unsigned char)text[i + 1]] ==
+                        LISP_READ_DIGIT)) {
+            if (c == '-') {
+                i += 1;
             }
-            x->number /= y->number;
-        }
-        if (strcmp(op, "%") == 0) {
-            if (y->number == 0) {
-                lisp_value_delete(x);
-                lisp_value_delete(y);
-                x = lisp_value_error("Division by zero.");
-                break;
+            size_t digits = i;
+            while (i < length &&
+                   lisp_read_classes[(unsigned char)text[i]] ==
+                       LISP_READ_DIGIT) {
+                i += 1;
+            }
+            lisp_reader_push(reader, lisp_read_number(text + digits,
+                                                      i - digits, c == '-'));
+        } else if (class == LISP_READ_SYMBOL) {
+            i = lisp_scan(&scanner, i, LISP_SCAN_WORD, false);
+            lisp_reader_push(
+                reader, lisp_reader_symbol(reader, text + start, i - start));
+        } else if (c == '"') {
+            i = lisp_scan(&scanner, i + 1, LISP_SCAN_QUOTE, true);
+            while (i < length && text[i] == '\\') {
+                i = lisp_scan(&scanner, i + 2, LISP_SCAN_QUOTE, true);
             }
-            x->number %= y->number;
+            if (i >= length) {
+                return lisp_reader_fail(reader, start,
+                                        "string is never closed");
+            }
+            i += 1;
+            lisp_reader_push(reader,
+                             lisp_read_string(text + start + 1, i - start - 2));
+        } else if (c == ';') {
+            i = lisp_scan(&scanner, i, LISP_SCAN_NEWLINE, true);
+        } else if (c == '(' || c == '{') {
+            if (reader->open_count == reader->open_capacity) {
+                reader->open_capacity = reader->open_capacity * 2 + 16;
+                reader->opens =
+                    realloc(reader->opens,
+                            sizeof(lisp_read_open) * reader->open_capacity);
+            }
+            lisp_read_open* open = &reader->opens[reader->open_count];
+            open->first = reader->value_count;
+            open->offset = start;
+            open->open = c;
+            reader->open_count += 1;
+            i += 1;
+        } else if (c == ')' || c == '}') {
+            char open = c == ')' ? '(' : '{';
+            if (reader->open_count == 0 ||
+                reader->opens[reader->open_count - 1].open != open) {
+                return lisp_reader_fail(
+                    reader, start,
+                    c == ')' ? "unexpected ')'" : "unexpected '}'");
+            }
+            reader->open_count -= 1;
+            lisp_reader_push(
+                reader, lisp_reader_collect(
+                            reader, reader->opens[reader->open_count].first,
+                            open == '(' ? LISP_VALUE_SEXPRESSION
+                                        : LISP_VALUE_QEXPRESSION));
+            i += 1;
+        } else {
+            return lisp_reader_fail(reader, start, "unexpected character");
         }
-        lisp_value_delete(y);
     }
-    lisp_value_delete(arguments);
-    return x;
 }
 
-lisp_value* builtin_add(lisp_environment* const environment,
-                        lisp_value* const arguments) {
-    return builtin_op(environment, arguments, "+");
-}
+/* Reading on threads, with --read-threads. A pass over the text that follows
+ * only brackets, strings and comments cuts it into chunks where top-level
+ * forms start, and the chunks of a round are read at once by a pool of
+ * threads, each into a heap of its own that is handed over when the round is
+ * done. A chunk starts where reading straight through would find a form, so
+ * its forms are the same ones, and the forms of the round are taken in the
+ * order of the text. */
+#ifndef LISP_READ_CHUNK_SIZE
+#define LISP_READ_CHUNK_SIZE (1 << 20)
+#endif
 
-lisp_value* builtin_sub(lisp_environment* const environment,
-                        lisp_value* const arguments) {
-    return builtin_op(environment, arguments, "-");
-}
+typedef struct {
+    const char* name;
+    const char* text;
+    size_t start;
+    size_t end;
+    bool shared; /* Whether other chunks are being read at the same time */
+    lisp_heap* heap;
+    lisp_value** forms;
+    size_t* offsets; /* Where each form starts */
+    size_t count;
+    size_t capacity;
+    lisp_value* error;
+} lisp_read_chunk;
 
-lisp_value* builtin_mul(lisp_environment* const environment,
-                        lisp_value* const arguments) {
-    return builtin_op(environment, arguments, "*");
+void lisp_read_chunk_run(lisp_read_chunk* const chunk) {
+    lisp_heap* previous = lisp_heap_enter(chunk->heap);
+    lisp_reader reader;
+    lisp_reader_init(&reader, chunk->name, chunk->text, chunk->end);
+    reader.offset = chunk->start;
+#ifdef LISP_READ_THREADS
+    char* symbols[LISP_SYMBOL_CACHE_SIZE] = {NULL};
+    if (chunk->shared) {
+        reader.symbols = symbols;
+    }
+#endif
+    lisp_value* form;
+    while ((form = lisp_reader_next(&reader)) != NULL) {
+        if (chunk->count == chunk->capacity) {
+            chunk->capacity = chunk->capacity * 2 + 64;
+            chunk->forms =
+                realloc(chunk->forms, sizeof(lisp_value*) * chunk->capacity);
+            chunk->offsets =
+                realloc(chunk->offsets, sizeof(size_t) * chunk->capacity);
+        }
+        chunk->forms[chunk->count] = form;
+        chunk->offsets[chunk->count] = reader.form;
+        chunk->count += 1;
+    }
+    chunk->error = reader.error;
+    reader.error = NULL;
+    lisp_reader_free(&reader);
+    lisp_heap_enter(previous);
 }
 
-lisp_value* builtin_div(lisp_environment* const environment,
-                        lisp_value* const arguments) {
-    return builtin_op(environment, arguments, "/");
+void lisp_read_chunk_free(lisp_read_chunk* const chunk) {
+    free(chunk->forms);
+    free(chunk->offsets);
 }
 
-lisp_value* builtin_mod(lisp_environment* const environment,
-                        lisp_value* const arguments) {
-    return builtin_op(environment, arguments, "%");
+#ifdef LISP_READ_THREADS
+
+/* The threads reading chunks, started as they are first needed. They take
+ * the chunks of a round in turn until none are left. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* Signalled when a round starts */
+    pthread_cond_t done; /* Signalled when the last chunk is read */
+    lisp_read_chunk* chunks;
+    size_t count;
+    size_t next;
+    size_t finished;
+    size_t threads;
+} lisp_read_pool;
+
+lisp_read_pool lisp_read_workers = {PTHREAD_MUTEX_INITIALIZER,
+                                    PTHREAD_COND_INITIALIZER,
+                                    PTHREAD_COND_INITIALIZER,
+                                    NULL,
+                                    0,
+                                    0,
+                                    0,
+                                    0};
+
+/* Read chunks until none are left. The lock is held on entry and exit. */
+void lisp_read_pool_work(lisp_read_pool* const pool) {
+    while (pool->next < pool->count) {
+        lisp_read_chunk* chunk = &pool->chunks[pool->next];
+        pool->next += 1;
+        pthread_mutex_unlock(&pool->lock);
+        lisp_read_chunk_run(chunk);
+        pthread_mutex_lock(&pool->lock);
+        pool->finished += 1;
+        if (pool->finished == pool->count) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
 }
 
-lisp_value* builtin_lambda(lisp_environment* const environment,
-                           lisp_value* const arguments) {
-    if (arguments->count != 2) {
-        lisp_value* error = lisp_value_error(
-            "Function '\\' expects 2 arguments. Got %li.", arguments->count);
-        lisp_value_delete(arguments);
-        return error;
+void* lisp_read_pool_thread(void* const argument) {
+    lisp_read_pool* pool = argument;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        lisp_read_pool_work(pool);
+        pthread_cond_wait(&pool->work, &pool->lock);
     }
-    if (arguments->cell[0]->type != LISP_VALUE_QEXPRESSION) {
-        lisp_value* error = lisp_value_error(
-            "Function '\\' expects first argument to be Q-Expression. Got "
-            "'%s'.",
-            lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
+    return NULL;
+}
+
+#endif
+
+size_t lisp_read_threads = 1;
+
+/* Read "count" chunks on the pool, with this thread taking its share */
+void lisp_read_pool_run(lisp_read_chunk* const chunks, const size_t count) {
+#ifdef LISP_READ_THREADS
+    lisp_read_pool* pool = &lisp_read_workers;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->threads + 1 < lisp_read_threads) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, lisp_read_pool_thread, pool) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        pool->threads += 1;
     }
-    if (arguments->cell[1]->type != LISP_VALUE_QEXPRESSION) {
-        lisp_value* error = lisp_value_error(
-            "Function '\\' expects second argument to be Q-Expression. Got "
-            "'%s'.",
-            lisp_type_name(arguments->cell[1]->type));
-        lisp_value_delete(arguments);
-        return error;
+    pool->chunks = chunks;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pthread_cond_broadcast(&pool->work);
+    lisp_read_pool_work(pool);
+    while (pool->finished < pool->count) {
+        pthread_cond_wait(&pool->done, &pool->lock);
     }
-    for (size_t i = 0; i < arguments->cell[0]->count; i += 1) {
-        if (arguments->cell[0]->cell[i]->type != LISP_VALUE_SYMBOL) {
-            lisp_value* error = lisp_value_error(
-                "Cannot define non-symbol. Expected Symbol. Got '%s'.",
-                lisp_type_name(arguments->cell[0]->cell[i]->type));
-            lisp_value_delete(arguments);
-            return error;
-        }
+    pool->chunks = NULL;
+    pool->count = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+#else
+    for (size_t i = 0; i < count; i += 1) {
+        lisp_read_chunk_run(&chunks[i]);
     }
-    lisp_value* formals = lisp_value_pop(arguments, 0);
-    lisp_value* body = lisp_value_pop(arguments, 0);
-    lisp_value_delete(arguments);
-    return lisp_value_lambda(formals, body);
+#endif
 }
 
-lisp_value* builtin_var(lisp_environment* const environment,
-                        lisp_value* const arguments,
-                        const char* const function) {
-    if (arguments->cell[0]->type != LISP_VALUE_QEXPRESSION) {
-        lisp_value* error = lisp_value_error(
-            "Function '%s' expects a Q-Expression for its first argument. "
-            "Got '%s'.",
-            function, lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
-    }
-    lisp_value* symbols = arguments->cell[0];
-    if (symbols->count != arguments->count - 1) {
-        lisp_value* error = lisp_value_error(
-            "Function '%s' passed incorrect number of argument. Expected "
-            "%li. Got %li.",
-            function, arguments->count - 1, symbols->count);
-        lisp_value_delete(arguments);
-        return error;
+/* The first offset at least "size" on from "i" where a top-level form may
+ * start. Where the text does not read, its end, so that the reader meets the
+ * error just as it would reading straight through. */
+size_t lisp_read_split(lisp_scanner* const scanner, size_t i,
+                       const size_t size) {
+    const char* const text = scanner->text;
+    const size_t length = scanner->length;
+    if (length - i <= size) {
+        return length;
     }
-    for (size_t i = 0; i < symbols->count; i += 1) {
-        if (symbols->cell[i]->type != LISP_VALUE_SYMBOL) {
-            lisp_value* error = lisp_value_error(
-                "Function '%s' cannot define non-symbol. Expected 'Symbol'. "
-                "Got '%s'.",
-                function, symbols->cell[i]->type);
-            lisp_value_delete(arguments);
-            return error;
+    size_t goal = i + size;
+    size_t depth = 0;
+    for (;;) {
+        if (depth == 0 && i >= goal) {
+            return i;
         }
-    }
-    if (strcmp(function, "def") == 0) {
-        for (size_t i = 0; i < symbols->count; i += 1) {
-            lisp_environment_def(environment, symbols->cell[i],
-                                 arguments->cell[i + 1]);
+        i = lisp_scan(scanner, i, LISP_SCAN_SYNTAX, true);
+        if (i == length) {
+            return length;
         }
-    } else if (strcmp(function, "=") == 0) {
-        for (size_t i = 0; i < symbols->count; i += 1) {
-            lisp_environment_put(environment, symbols->cell[i],
-                                 arguments->cell[i + 1]);
+        char c = text[i];
+        if (c == '(' || c == '{') {
+            depth += 1;
+        } else if ((c == ')' || c == '}') && depth > 0) {
+            depth -= 1;
+        } else if (c == '"') {
+            i = lisp_scan(scanner, i + 1, LISP_SCAN_QUOTE, true);
+            while (i < length && text[i] == '\\') {
+                i = lisp_scan(scanner, i + 2, LISP_SCAN_QUOTE, true);
+            }
+            if (i >= length) {
+                return length;
+            }
+        } else if (c == ';') {
+            i = lisp_scan(scanner, i, LISP_SCAN_NEWLINE, true);
+            continue;
+        } else {
+            return length;
         }
+        i += 1;
     }
-    lisp_value_delete(arguments);
-    return lisp_value_sexpression();
-}
-
-lisp_value* builtin_def(lisp_environment* const environment,
-                        lisp_value* const arguments) {
-    return builtin_var(environment, arguments, "def");
-}
-
-lisp_value* builtin_put(lisp_environment* const environment,
-                        lisp_value* const arguments) {
-    return builtin_var(environment, arguments, "=");
 }
 
-lisp_value* builtin_order(lisp_environment* const environment,
-                          lisp_value* const arguments, const char* const op) {
-    if (arguments->count != 2) {
-        lisp_value* error =
-            lisp_value_error("Function '%s' expects 2 arguments. Got %li.", op,
-                             arguments->count);
-        lisp_value_delete(arguments);
-        return error;
+/* Cut the text of "reader" from where it has got to into as many as "count"
+ * chunks, and read them. Returns how many there were. */
+size_t lisp_read_round(lisp_reader* const reader,
+                       lisp_read_chunk* const chunks, const size_t count) {
+    size_t round = 0;
+    while (round < count && reader->offset < reader->length) {
+        lisp_read_chunk* chunk = &chunks[round];
+        chunk->name = reader->name;
+        chunk->text = reader->text;
+        chunk->start = reader->offset;
+        chunk->end = count == 1 ? reader->length
+                                : lisp_read_split(&reader->scanner,
+                                                  reader->offset,
+                                                  LISP_READ_CHUNK_SIZE);
+        chunk->shared = false;
+        chunk->heap = NULL;
+        chunk->forms = NULL;
+        chunk->offsets = NULL;
+        chunk->count = 0;
+        chunk->capacity = 0;
+        chunk->error = NULL;
+        reader->offset = chunk->end;
+        round += 1;
     }
-    if (arguments->cell[0]->type != LISP_VALUE_NUMBER) {
-        lisp_value* error = lisp_value_error(
-            "Function '%s' expects a Number for its first argument. Got '%s'.",
-            op, lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
+    if (round == 1) {
+        lisp_read_chunk_run(&chunks[0]);
+    } else if (round > 1) {
+        for (size_t i = 0; i < round; i += 1) {
+            chunks[i].shared = true;
+            chunks[i].heap = lisp_heap_new();
+        }
+        lisp_read_pool_run(chunks, round);
+        lisp_heap* heap = lisp_heap_enter(NULL);
+        for (size_t i = 0; i < round; i += 1) {
+            lisp_heap_adopt(heap, chunks[i].heap);
+        }
     }
-    if (arguments->cell[1]->type != LISP_VALUE_NUMBER) {
-        lisp_value* error = lisp_value_error(
-            "Function '%s' expects a Number for its second argument. Got '%s'.",
-            op, lisp_type_name(arguments->cell[1]->type));
-        lisp_value_delete(arguments);
-        return error;
+    return round;
+}
+
+/* Read every form in the "length" characters of "text" into an
+ * S-Expression, or return an Error saying where they went wrong. "name" is
+ * where the text came from. */
+lisp_value* lisp_read(const char* const name, const char* const text,
+                      const size_t length) {
+    lisp_reader reader;
+    lisp_reader_init(&reader, name, text, length);
+    size_t threads = length > LISP_READ_CHUNK_SIZE ? lisp_read_threads : 1;
+    lisp_read_chunk* chunks = malloc(sizeof(lisp_read_chunk) * threads);
+    lisp_value** forms = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    while (reader.error == NULL && reader.offset < length) {
+        size_t round = lisp_read_round(&reader, chunks, threads);
+        for (size_t i = 0; i < round; i += 1) {
+            lisp_read_chunk* chunk = &chunks[i];
+            if (reader.error != NULL) {
+                for (size_t j = 0; j < chunk->count; j += 1) {
+                    lisp_value_delete(chunk->forms[j]);
+                }
+                if (chunk->error != NULL) {
+                    lisp_value_delete(chunk->error);
+                }
+            } else {
+                if (count + chunk->count > capacity) {
+                    capacity = (count + chunk->count) * 2;
+                    forms = realloc(forms, sizeof(lisp_value*) * capacity);
+                }
+                for (size_t j = 0; j < chunk->count; j += 1) {
+                    forms[count] = chunk->forms[j];
+                    count += 1;
+                }
+                reader.error = chunk->error;
+            }
+            lisp_read_chunk_free(chunk);
+        }
     }
-    int r;
-    if (strcmp(op, ">") == 0) {
-        r = arguments->cell[0]->number > arguments->cell[1]->number;
-    } else if (strcmp(op, "<") == 0) {
-        r = arguments->cell[0]->number < arguments->cell[1]->number;
-    } else if (strcmp(op, ">=") == 0) {
-        r = arguments->cell[0]->number >= arguments->cell[1]->number;
-    } else if (strcmp(op, "<=") == 0) {
-        r = arguments->cell[0]->number <= arguments->cell[1]->number;
+    free(chunks);
+    lisp_value* result;
+    if (reader.error != NULL) {
+        for (size_t i = 0; i < count; i += 1) {
+            lisp_value_delete(forms[i]);
+        }
+        result = reader.error;
+        reader.error = NULL;
     } else {
-        lisp_value_delete(arguments);
-        return lisp_value_error("Unknown function order function '%s'.", op);
+        result = lisp_read_expression(forms, count, LISP_VALUE_SEXPRESSION);
     }
-    lisp_value_delete(arguments);
-    return lisp_value_number(r);
+    free(forms);
+    lisp_reader_free(&reader);
+    return result;
+}
+
+/* The grammar for --mpc-reader, built the first time it is needed */
+void lisp_mpc_grammar() {
+    if (Lispy != NULL) {
+        return;
+    }
+    Number = mpc_new("number");
+    String = mpc_new("string");
+    Symbol = mpc_new("symbol");
+    Comment = mpc_new("comment");
+    Qexpression = mpc_new("qexpression");
+    Sexpression = mpc_new("sexpression");
+    Expression = mpc_new("expression");
+    Lispy = mpc_new("lispy");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+              "\
+            number: /-?[0-9]+/ ;\
+            string: /\"(\\\\.|[^\"])*\"/ ;\
+            symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;\
+            comment: /;[^\\r\\n]*/;\
+            qexpression: '{' <expression>* '}';\
+            sexpression: '(' <expression>* ')';\
+            expression: <number> | <string> | <symbol> | <sexpression> \
+                        | <qexpression> | <comment> ;\
+            lispy: /^/ <expression>* /$/;\
+            ",
+              Number, String, Symbol, Comment, Qexpression, Sexpression,
+              Expression, Lispy);
+}
+
+/* Read the forms in "text" with the reader selected */
+lisp_value* lisp_read_text(const char* const name, const char* const text,
+                           const size_t length) {
+    if (!lisp_reader_mpc) {
+        return lisp_read(name, text, length);
+    }
+    lisp_mpc_grammar();
+    mpc_result_t result;
+    if (!mpc_parse(name, text, Lispy, &result)) {
+        char* message = mpc_err_string(result.error);
+        mpc_err_delete(result.error);
+        lisp_value* error = lisp_value_error("%s", message);
+        free(message);
+        return error;
+    }
+    lisp_value* forms = lisp_value_read(result.output);
+    mpc_ast_delete(result.output);
+    return forms;
+}
+
+/* All that is left to read of "file", or NULL if it can't be read */
+char* lisp_read_stream(FILE* const file, size_t* const length) {
+    size_t capacity = 4096;
+    char* text = malloc(capacity);
+    *length = 0;
+    for (;;) {
+        *length += fread(text + *length, 1, capacity - *length - 1, file);
+        if (*length < capacity - 1) {
+            break;
+        }
+        capacity *= 2;
+        text = realloc(text, capacity);
+    }
+    if (ferror(file)) {
+        free(text);
+        return NULL;
+    }
+    text[*length] = '\0';
+    return text;
+}
+
+/* The contents of the file "name", terminated, or NULL if it cannot be
+ * read */
+char* lisp_read_contents(const char* const name, size_t* const length) {
+    FILE* file = fopen(name, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    char* text = lisp_read_stream(file, length);
+    fclose(file);
+    return text;
+}
+
+lisp_value* lisp_read_file(const char* const name) {
+    size_t length;
+    char* text = lisp_read_contents(name, &length);
+    if (text == NULL) {
+        return lisp_value_error("%s: error: Unable to open file!", name);
+    }
+    lisp_value* forms = lisp_read_text(name, text, length);
+    free(text);
+    return forms;
+}
+
+/* The text of a file, mapped if it can be and read into memory if not */
+typedef struct {
+    char* text;
+    size_t length;
+    bool mapped;
+} lisp_source;
+
+bool lisp_source_open(lisp_source* const source, const char* const name) {
+    source->mapped = false;
+    int file = open(name, O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat status;
+    if (fstat(file, &status) == 0 && S_ISREG(status.st_mode) &&
+        status.st_size > 0) {
+        void* text =
+            mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (text != MAP_FAILED) {
+            posix_madvise(text, status.st_size, POSIX_MADV_SEQUENTIAL);
+            source->text = text;
+            source->length = status.st_size;
+            source->mapped = true;
+        }
+    }
+    close(file);
+    if (!source->mapped) {
+        source->text = lisp_read_contents(name, &source->length);
+    }
+    return source->text != NULL;
+}
+
+void lisp_source_close(lisp_source* const source) {
+    if (source->mapped) {
+        munmap(source->text, source->length);
+    } else {
+        free(source->text);
+    }
+}
+
+/* "--bench-reader FILE" reads FILE over and over for a second or so with
+ * the reader selected, and reports how fast that went */
+int lisp_read_benchmark(const char* const name) {
+    size_t length;
+    char* text = lisp_read_contents(name, &length);
+    if (text == NULL) {
+        perror(name);
+        return 1;
+    }
+    struct timespec start;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t rounds = 0;
+    double seconds;
+    do {
+        lisp_value* forms = lisp_read_text(name, text, length);
+        if (lisp_value_type(forms) == LISP_VALUE_ERROR) {
+            fprintf(stderr, "%s\n", forms->error);
+            lisp_value_delete(forms);
+            free(text);
+            return 1;
+        }
+        lisp_value_delete(forms);
+        rounds += 1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (now.tv_sec - start.tv_sec) +
+                  (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while (seconds < 1);
+    if (lisp_reader_mpc) {
+        printf("mpc reader: ");
+    } else {
+        printf("Hand-written reader, %s scanning, %zu thread%s: ",
+               lisp_scan_name, lisp_read_threads,
+               lisp_read_threads == 1 ? "" : "s");
+    }
+    printf("%zu bytes %zu times in %.2f s, %.1f MB/s\n", length, rounds,
+           seconds, length * rounds / seconds / 1e6);
+    free(text);
+    return 0;
+}
+
+/* How many values "value" is made of, not counting immediates */
+size_t lisp_value_nodes(lisp_value* const value) {
+    size_t count = 0;
+    size_t base = lisp_value_pending.count;
+    lisp_value_push_pending(value);
+    while (lisp_value_pending.count > base) {
+        lisp_value* x = lisp_value_pop_pending();
+        if (lisp_value_is_immediate(x)) {
+            continue;
+        }
+        count += 1;
+        if (x->type == LISP_VALUE_SEXPRESSION ||
+            x->type == LISP_VALUE_QEXPRESSION) {
+            for (size_t i = 0; i < x->count; i += 1) {
+                lisp_value_push_pending(x->cell[i]);
+            }
+        }
+    }
+    return count;
+}
+
+/* A value as it was before it kept only the fields its type uses, for
+ * --bench-memory to compare with */
+typedef struct {
+    int type;
+    bool marked;
+    size_t references;
+    long number;
+    char* error;
+    char* symbol;
+    char* string;
+    lisp_builtin builtin;
+    lisp_environment* environment;
+    lisp_value* formals;
+    lisp_value* body;
+    size_t count;
+    lisp_value** cell;
+} lisp_value_unpacked;
+
+/* "--bench-memory FILE" reads the forms of FILE and reports how much memory
+ * their values take, against what they took before, and how many
+ * allocations it took, to compare the slab heaps with ALLOCATOR=malloc */
+int lisp_memory_benchmark(const char* const name) {
+    size_t length;
+    char* text = lisp_read_contents(name, &length);
+    if (text == NULL) {
+        perror(name);
+        return 1;
+    }
+    size_t allocations = lisp_system_allocations;
+    lisp_value* forms = lisp_read_text(name, text, length);
+    allocations = lisp_system_allocations - allocations;
+    if (lisp_value_type(forms) == LISP_VALUE_ERROR) {
+        fprintf(stderr, "%s\n", forms->error);
+        lisp_value_delete(forms);
+        free(text);
+        return 1;
+    }
+    size_t nodes = lisp_value_nodes(forms);
+#ifdef LISP_ALLOCATOR_MALLOC
+    printf("malloc: ");
+#else
+    printf("Slab heaps: ");
+#endif
+    printf("%zu values of %zu bytes, %.1f MB, where values of %zu bytes "
+           "took %.1f MB; %zu allocations\n",
+           nodes, sizeof(lisp_value), nodes * sizeof(lisp_value) / 1e6,
+           sizeof(lisp_value_unpacked),
+           nodes * sizeof(lisp_value_unpacked) / 1e6, allocations);
+    lisp_value_delete(forms);
+    free(text);
+    return 0;
+}
+
+/* Values are printed into a buffer that is kept from one print to the next,
+ * and handed to stdio a chunk at a time rather than a character at a time */
+#ifndef LISP_OUTPUT_CHUNK
+#define LISP_OUTPUT_CHUNK (1 << 16)
+#endif
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} lisp_buffer;
+
+lisp_buffer lisp_output = {NULL, 0, 0};
+
+void lisp_output_flush() {
+    fwrite(lisp_output.data, 1, lisp_output.length, stdout);
+    lisp_output.length = 0;
+}
+
+/* Room for "size" more characters at the end of "buffer". Rather than grow
+ * past a chunk, the output is written out. */
+char* lisp_buffer_reserve(lisp_buffer* const buffer, const size_t size) {
+    if (buffer->length + size > buffer->capacity) {
+        if (buffer == &lisp_output && buffer->length > 0) {
+            lisp_output_flush();
+        }
+        while (buffer->length + size > buffer->capacity) {
+            buffer->capacity = buffer->capacity * 2 + LISP_OUTPUT_CHUNK;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    return buffer->data + buffer->length;
+}
+
+void lisp_buffer_add(lisp_buffer* const buffer, const char* const text,
+                     const size_t length) {
+    memcpy(lisp_buffer_reserve(buffer, length), text, length);
+    buffer->length += length;
+}
+
+void lisp_buffer_add_char(lisp_buffer* const buffer, const char c) {
+    *lisp_buffer_reserve(buffer, 1) = c;
+    buffer->length += 1;
+}
+
+void lisp_buffer_add_text(lisp_buffer* const buffer, const char* const text) {
+    lisp_buffer_add(buffer, text, strlen(text));
+}
+
+const char lisp_digit_pairs[] = "00010203040506070809"
+                                "10111213141516171819"
+                                "20212223242526272829"
+                                "30313233343536373839"
+                                "40414243444546474849"
+                                "50515253545556575859"
+                                "60616263646566676869"
+                                "70717273747576777879"
+                                "80818283848586878889"
+                                "90919293949596979899";
+
+/* Write "number" in decimal, two digits at a time from the right */
+void lisp_buffer_add_number(lisp_buffer* const buffer, const long number) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    unsigned long n = number < 0 ? 0ul - (unsigned long)number : number;
+    while (n >= 100) {
+        start -= 2;
+        memcpy(start, lisp_digit_pairs + (n % 100) * 2, 2);
+        n /= 100;
+    }
+    if (n >= 10) {
+        start -= 2;
+        memcpy(start, lisp_digit_pairs + n * 2, 2);
+    } else {
+        start -= 1;
+        *start = '0' + n;
+    }
+    if (number < 0) {
+        start -= 1;
+        *start = '-';
+    }
+    lisp_buffer_add(buffer, start, end - start);
+}
+
+/* The escapes mpcf_escape writes, by the character they stand for */
+const char lisp_print_escapes[256] = {
+    ['\a'] = 'a', ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n',   ['\r'] = 'r',
+    ['\t'] = 't', ['\v'] = 'v', ['\\'] = '\\', ['\''] = '\'', ['"'] = '"'};
+
+/* Write "string" quoted and escaped, straight into the buffer */
+void lisp_buffer_add_string(lisp_buffer* const buffer,
+                            const char* const string) {
+    size_t length = strlen(string);
+    char* start = lisp_buffer_reserve(buffer, length * 2 + 2);
+    char* c = start;
+    *c = '"';
+    c += 1;
+    for (size_t i = 0; i < length; i += 1) {
+        char escape = lisp_print_escapes[(unsigned char)string[i]];
+        if (escape != 0) {
+            c[0] = '\\';
+            c[1] = escape;
+            c += 2;
+        } else {
+            *c = string[i];
+            c += 1;
+        }
+    }
+    *c = '"';
+    buffer->length += c + 1 - start;
+}
+
+/* Write "value" if it has no parts, or what comes before them if it does, and
+ * return whether it does */
+bool lisp_buffer_add_opening(lisp_buffer* const buffer,
+                             const lisp_value* const value) {
+    switch (lisp_value_type(value)) {
+        case LISP_VALUE_NUMBER:
+            lisp_buffer_add_number(buffer, lisp_value_get_number(value));
+            break;
+        case LISP_VALUE_STRING:
+            lisp_buffer_add_string(buffer, value->string);
+            break;
+        case LISP_VALUE_FUNCTION:
+            if (lisp_value_is_builtin(value)) {
+                lisp_buffer_add_text(buffer, "<builtin>");
+                break;
+            }
+            lisp_buffer_add_text(buffer, "(\\ ");
+            return true;
+        case LISP_VALUE_ERROR:
+            lisp_buffer_add_text(buffer, "Error: ");
+            lisp_buffer_add_text(buffer, value->error);
+            break;
+        case LISP_VALUE_SYMBOL:
+            lisp_buffer_add_text(buffer, value->symbol);
+            break;
+        case LISP_VALUE_QEXPRESSION:
+            lisp_buffer_add_char(buffer, '{');
+            return true;
+        case LISP_VALUE_SEXPRESSION:
+            lisp_buffer_add_char(buffer, '(');
+            return true;
+    }
+    return false;
+}
+
+/* Write "value" as it is printed. A lambda is written with its formals and
+ * body as its two parts. */
+void lisp_buffer_add_value(lisp_buffer* const buffer,
+                           const lisp_value* const value) {
+    size_t base = lisp_walk_stack.count;
+    if (lisp_buffer_add_opening(buffer, value)) {
+        lisp_walk_enter(value);
+    }
+    while (lisp_walk_stack.count > base) {
+        lisp_walk_frame* frame = lisp_walk_top();
+        const lisp_value* x = frame->value;
+        int type = lisp_value_type(x);
+        size_t parts = type == LISP_VALUE_FUNCTION ? 2 : lisp_value_count(x);
+        if (frame->next == parts) {
+            lisp_buffer_add_char(buffer,
+                                 type == LISP_VALUE_QEXPRESSION ? '}' : ')');
+            lisp_walk_stack.count -= 1;
+            continue;
+        }
+        if (frame->next > 0) {
+            lisp_buffer_add_char(buffer, ' ');
+        }
+        const lisp_value* part;
+        if (type == LISP_VALUE_FUNCTION) {
+            part = frame->next == 0 ? x->formals : x->body;
+        } else {
+            part = x->cell[frame->next];
+        }
+        frame->next += 1;
+        if (lisp_buffer_add_opening(buffer, part)) {
+            lisp_walk_enter(part);
+        }
+    }
+}
+
+void lisp_value_print(const lisp_value* const value) {
+    lisp_buffer_add_value(&lisp_output, value);
+    lisp_output_flush();
+}
+
+void lisp_value_println(const lisp_value* const value) {
+    lisp_buffer_add_value(&lisp_output, value);
+    lisp_buffer_add_char(&lisp_output, '\n');
+    lisp_output_flush();
+}
+
+/* "value" must not be shared; see lisp_value_unshare */
+lisp_value* lisp_value_pop(lisp_value* const value, size_t i) {
+    lisp_value* x = value->cell[i];
+
+    /* Shift memory after the item at "i" over the top */
+    memmove(&value->cell[i], &value->cell[i + 1],
+            sizeof(lisp_value*) * (value->count - i - 1));
+
+    value->count -= 1;
+
+    /* Reallocate the memory used */
+    value->cell =
+        lisp_reallocate(value->cell, sizeof(lisp_value*) * value->count);
+    return x;
+}
+
+lisp_value* lisp_value_take(lisp_value* const value, size_t i) {
+    lisp_value* x = lisp_value_pop(value, i);
+    lisp_value_delete(value);
+    return x;
+}
+
+lisp_value* builtin_head(lisp_environment* const environment,
+                         lisp_value* const arguments) {
+    if (arguments->count > 1) {
+        lisp_value* error = lisp_value_error(
+            "Function 'head' passed too many arguments. Expected 1. Got %li.",
+            arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_QEXPRESSION) {
+        lisp_value* error = lisp_value_error(
+            "Function 'head' passed an incorrect type '%s'. Expected "
+            "Q-Expression.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_count(arguments->cell[0]) == 0) {
+        lisp_value_delete(arguments);
+        return lisp_value_error("Function 'head' passed {}.");
+    }
+    lisp_value* value = lisp_value_unshare(lisp_value_take(arguments, 0));
+    while (value->count > 1) {
+        lisp_value_delete(lisp_value_pop(value, 1));
+    }
+    return value;
+}
+
+lisp_value* builtin_tail(lisp_environment* const environment,
+                         lisp_value* const arguments) {
+    if (arguments->count > 1) {
+        lisp_value* error = lisp_value_error(
+            "Function 'tail' passed too many arguments. Expected 1. Got %li.",
+            arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_QEXPRESSION) {
+        lisp_value* error = lisp_value_error(
+            "Function 'tail' passed an incorrect type '%s'. Expected "
+            "Q-Expression.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_count(arguments->cell[0]) == 0) {
+        lisp_value_delete(arguments);
+        return lisp_value_error("Function 'tail' passed {}.");
+    }
+    lisp_value* value = lisp_value_unshare(lisp_value_take(arguments, 0));
+    lisp_value_delete(lisp_value_pop(value, 0));
+    return value;
+}
+
+lisp_value* builtin_list(lisp_environment* const environment,
+                         lisp_value* const arguments) {
+    return lisp_value_retype(arguments, LISP_VALUE_QEXPRESSION);
+}
+
+lisp_value* lisp_value_evaluate(lisp_environment* const environment,
+                                lisp_value* value);
+
+/* Check the arguments of 'eval' and return the expression it evaluates */
+lisp_value* lisp_value_eval_expression(lisp_value* const arguments) {
+    if (arguments->count > 1) {
+        lisp_value* error = lisp_value_error(
+            "Function 'eval' passed too many arguments. Expected 1. Got %li.",
+            arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_QEXPRESSION) {
+        lisp_value* error = lisp_value_error(
+            "Function 'eval' passed incorrect type '%s'. Expected "
+            "Q-Expression.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    return lisp_value_retype(lisp_value_take(arguments, 0),
+                             LISP_VALUE_SEXPRESSION);
+}
+
+lisp_value* builtin_eval(lisp_environment* const environment,
+                         lisp_value* const arguments) {
+    lisp_value* x = lisp_value_eval_expression(arguments);
+    if (lisp_value_type(x) == LISP_VALUE_ERROR) {
+        return x;
+    }
+    return lisp_value_evaluate(environment, x);
+}
+
+lisp_value* builtin_join(lisp_environment* const environment,
+                         lisp_value* const arguments) {
+    for (size_t i = 0; i < arguments->count; i += 1) {
+        if (lisp_value_type(arguments->cell[i]) != LISP_VALUE_QEXPRESSION) {
+            lisp_value* error = lisp_value_error(
+                "Function 'join' passed incorrect type '%s'. Expected "
+                "Q-Expression.",
+                lisp_type_name(lisp_value_type(arguments->cell[i])));
+            lisp_value_delete(arguments);
+            return error;
+        }
+    }
+    lisp_value* x = lisp_value_pop(arguments, 0);
+    while (arguments->count > 0) {
+        lisp_value* y = lisp_value_pop(arguments, 0);
+        if (lisp_value_is_immediate(y) || y->references > 1) {
+            for (size_t i = 0; i < lisp_value_count(y); i += 1) {
+                x = lisp_value_add(x, lisp_value_retain(y->cell[i]));
+            }
+            lisp_value_delete(y);
+        } else {
+            for (size_t i = 0; i < y->count; i += 1) {
+                x = lisp_value_add(x, y->cell[i]);
+            }
+            /* We don't want to get rid off the y->cell[i]'s, so we cannot call
+             * lisp_value_delete(y)
+             */
+            lisp_free(y->cell);
+            lisp_code_free(y->code);
+            lisp_free(y);
+        }
+    }
+    lisp_value_delete(arguments);
+    return x;
+}
+
+/* The arithmetic builtins, the symbols they are bound to and their kernels.
+ * A kernel folds one more operand into the running value, and returns the
+ * error it runs into or NULL. */
+#define LISP_ARITHMETIC(X)              \
+    X(add, "+", "add", lisp_kernel_add) \
+    X(sub, "-", "sub", lisp_kernel_sub) \
+    X(mul, "*", "mul", lisp_kernel_mul) \
+    X(div, "/", "div", lisp_kernel_div) \
+    X(mod, "%", "mod", lisp_kernel_mod)
+
+typedef const char* (*lisp_kernel)(long* x, long y);
+
+const char* lisp_kernel_add(long* const x, const long y) {
+    if ((y > 0 && *x > LONG_MAX - y) || (y < 0 && *x < LONG_MIN - y)) {
+        return "Integer overflow.";
+    }
+    *x += y;
+    return NULL;
+}
+
+const char* lisp_kernel_sub(long* const x, const long y) {
+    if ((y < 0 && *x > LONG_MAX + y) || (y > 0 && *x < LONG_MIN + y)) {
+        return "Integer overflow.";
+    }
+    *x -= y;
+    return NULL;
+}
+
+const char* lisp_kernel_mul(long* const x, const long y) {
+    bool overflow;
+    if (*x > 0) {
+        overflow = y > 0 ? *x > LONG_MAX / y : y < LONG_MIN / *x;
+    } else {
+        overflow = y > 0 ? *x < LONG_MIN / y : *x != 0 && y < LONG_MAX / *x;
+    }
+    if (overflow) {
+        return "Integer overflow.";
+    }
+    *x *= y;
+    return NULL;
+}
+
+const char* lisp_kernel_div(long* const x, const long y) {
+    if (y == 0) {
+        return "Division by zero.";
+    }
+    if (y == -1 && *x == LONG_MIN) {
+        return "Integer overflow.";
+    }
+    *x /= y;
+    return NULL;
+}
+
+const char* lisp_kernel_mod(long* const x, const long y) {
+    if (y == 0) {
+        return "Division by zero.";
+    }
+    /* LONG_MIN % -1 is 0, but traps on some machines */
+    *x = y == -1 ? 0 : *x % y;
+    return NULL;
+}
+
+/* Fold the operands with "kernel" in one pass. The first error a kernel runs
+ * into is kept until every operand has been checked to be a Number, as a
+ * wrong type is reported ahead of it. */
+lisp_value* builtin_op(lisp_environment* const environment,
+                       lisp_value* const arguments, const lisp_kernel kernel) {
+    /* Work on plain longs so that no intermediate number is allocated */
+    long x = 0;
+    const char* failure = NULL;
+    for (size_t i = 0; i < arguments->count; i += 1) {
+        lisp_value* y = arguments->cell[i];
+        if (lisp_value_type(y) != LISP_VALUE_NUMBER) {
+            lisp_value* error =
+                lisp_value_error("Cannot operate on '%s'. Expected Number.",
+                                 lisp_type_name(lisp_value_type(y)));
+            lisp_value_delete(arguments);
+            return error;
+        }
+        if (i == 0) {
+            x = lisp_value_get_number(y);
+        } else if (failure == NULL) {
+            failure = kernel(&x, lisp_value_get_number(y));
+        }
+    }
+    if (kernel == lisp_kernel_sub && arguments->count == 1) {
+        long y = x;
+        x = 0;
+        failure = lisp_kernel_sub(&x, y);
+    }
+    lisp_value_delete(arguments);
+    if (failure != NULL) {
+        return lisp_value_error("%s", failure);
+    }
+    return lisp_value_number(x);
+}
+
+#define X(name, symbol, word, kernel)                               \
+    lisp_value* builtin_##name(lisp_environment* const environment, \
+                               lisp_value* const arguments) {       \
+        return builtin_op(environment, arguments, kernel);          \
+    }
+LISP_ARITHMETIC(X)
+#undef X
+
+/* Point every symbol in "body" that names one of "formals" at the frame slot
+ * the formal is bound to. Formals are bound in order, so the n-th one other
+ * than '&' lands in slot n. Scope is dynamic and a body can be shared between
+ * functions, so the slot is only a hint that lisp_environment_get checks
+ * against the frame before using. Anything else is still looked up by name.
+ * The hint does not change what the value means, so shared nodes are updated
+ * in place. */
+void lisp_value_resolve(lisp_value* const body,
+                        const lisp_value* const formals) {
+    size_t base = lisp_value_pending.count;
+    lisp_value_push_pending(body);
+    while (lisp_value_pending.count > base) {
+        lisp_value* x = lisp_value_pop_pending();
+        switch (lisp_value_type(x)) {
+            case LISP_VALUE_SYMBOL: {
+                size_t slot = 0;
+                x->slot = SIZE_MAX;
+                for (size_t i = 0; i < lisp_value_count(formals); i += 1) {
+                    char* symbol = formals->cell[i]->symbol;
+                    if (symbol == x->symbol) {
+                        x->slot = slot;
+                        break;
+                    }
+                    if (symbol != lisp_symbol_ampersand) {
+                        slot += 1;
+                    }
+                }
+                break;
+            }
+            case LISP_VALUE_QEXPRESSION:
+            case LISP_VALUE_SEXPRESSION:
+                for (size_t i = 0; i < lisp_value_count(x); i += 1) {
+                    lisp_value_push_pending(x->cell[i]);
+                }
+                break;
+        }
+    }
+}
+
+lisp_value* builtin_lambda(lisp_environment* const environment,
+                           lisp_value* const arguments) {
+    if (arguments->count != 2) {
+        lisp_value* error = lisp_value_error(
+            "Function '\\' expects 2 arguments. Got %li.", arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_QEXPRESSION) {
+        lisp_value* error = lisp_value_error(
+            "Function '\\' expects first argument to be Q-Expression. Got "
+            "'%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[1]) != LISP_VALUE_QEXPRESSION) {
+        lisp_value* error = lisp_value_error(
+            "Function '\\' expects second argument to be Q-Expression. Got "
+            "'%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[1])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    for (size_t i = 0; i < lisp_value_count(arguments->cell[0]); i += 1) {
+        if (lisp_value_type(arguments->cell[0]->cell[i]) != LISP_VALUE_SYMBOL) {
+            lisp_value* error = lisp_value_error(
+                "Cannot define non-symbol. Expected Symbol. Got '%s'.",
+                lisp_type_name(lisp_value_type(arguments->cell[0]->cell[i])));
+            lisp_value_delete(arguments);
+            return error;
+        }
+    }
+    lisp_value* formals = lisp_value_pop(arguments, 0);
+    lisp_value* body = lisp_value_pop(arguments, 0);
+    lisp_value_delete(arguments);
+    lisp_value_resolve(body, formals);
+    return lisp_value_lambda(formals, body);
+}
+
+lisp_value* builtin_var(lisp_environment* const environment,
+                        lisp_value* const arguments,
+                        const char* const function) {
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_QEXPRESSION) {
+        lisp_value* error = lisp_value_error(
+            "Function '%s' expects a Q-Expression for its first argument. "
+            "Got '%s'.",
+            function, lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    lisp_value* symbols = arguments->cell[0];
+    if (lisp_value_count(symbols) != arguments->count - 1) {
+        lisp_value* error = lisp_value_error(
+            "Function '%s' passed incorrect number of argument. Expected "
+            "%li. Got %li.",
+            function, arguments->count - 1, lisp_value_count(symbols));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    for (size_t i = 0; i < lisp_value_count(symbols); i += 1) {
+        if (lisp_value_type(symbols->cell[i]) != LISP_VALUE_SYMBOL) {
+            lisp_value* error = lisp_value_error(
+                "Function '%s' cannot define non-symbol. Expected 'Symbol'. "
+                "Got '%s'.",
+                function, lisp_value_type(symbols->cell[i]));
+            lisp_value_delete(arguments);
+            return error;
+        }
+    }
+    if (strcmp(function, "def") == 0) {
+        for (size_t i = 0; i < lisp_value_count(symbols); i += 1) {
+            lisp_environment_def(environment, symbols->cell[i],
+                                 arguments->cell[i + 1]);
+        }
+    } else if (strcmp(function, "=") == 0) {
+        for (size_t i = 0; i < lisp_value_count(symbols); i += 1) {
+            lisp_environment_put(environment, symbols->cell[i],
+                                 arguments->cell[i + 1]);
+        }
+    }
+    lisp_value_delete(arguments);
+    return lisp_value_sexpression();
+}
+
+lisp_value* builtin_def(lisp_environment* const environment,
+                        lisp_value* const arguments) {
+    return builtin_var(environment, arguments, "def");
+}
+
+lisp_value* builtin_put(lisp_environment* const environment,
+                        lisp_value* const arguments) {
+    return builtin_var(environment, arguments, "=");
+}
+
+/* The comparisons of two Numbers, with the C operator each applies */
+#define LISP_ORDER(X)                           \
+    X(greater_than, ">", "gt", >)               \
+    X(lesser_than, "<", "lt", <)                \
+    X(greater_than_or_equal_to, ">=", "ge", >=) \
+    X(lesser_than_or_equal_to, "<=", "le", <=)
+
+/* Check the arguments of the comparison "op". Returns NULL if they are two
+ * Numbers, or else the error, having deleted them. */
+lisp_value* lisp_value_order_check(lisp_value* const arguments,
+                                   const char* const op) {
+    if (arguments->count != 2) {
+        lisp_value* error =
+            lisp_value_error("Function '%s' expects 2 arguments. Got %li.", op,
+                             arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_NUMBER) {
+        lisp_value* error = lisp_value_error(
+            "Function '%s' expects a Number for its first argument. Got '%s'.",
+            op, lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[1]) != LISP_VALUE_NUMBER) {
+        lisp_value* error = lisp_value_error(
+            "Function '%s' expects a Number for its second argument. Got '%s'.",
+            op, lisp_type_name(lisp_value_type(arguments->cell[1])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    return NULL;
+}
+
+#define X(name, symbol, word, operator)                                \
+    lisp_value* builtin_##name(lisp_environment* const environment,    \
+                               lisp_value* const arguments) {          \
+        lisp_value* error = lisp_value_order_check(arguments, symbol); \
+        if (error != NULL) {                                           \
+            return error;                                              \
+        }                                                              \
+        int r = lisp_value_get_number(arguments->cell[0])              \
+            operator lisp_value_get_number(arguments->cell[1]);        \
+        lisp_value_delete(arguments);                                  \
+        return lisp_value_number(r);                                   \
+    }
+LISP_ORDER(X)
+#undef X
+
+/* Whether "x" and "y" are equal apart from their parts, which are left as
+ * pairs to compare in turn */
+int lisp_value_equal_outside(lisp_value* x, lisp_value* y) {
+    if (lisp_value_type(x) != lisp_value_type(y)) {
+        return 0;
+    }
+
+    switch (lisp_value_type(x)) {
+        case LISP_VALUE_NUMBER:
+            return lisp_value_get_number(x) == lisp_value_get_number(y);
+        case LISP_VALUE_STRING:
+            return strcmp(x->string, y->string) == 0;
+        case LISP_VALUE_ERROR:
+            return strcmp(x->error, y->error) == 0;
+        case LISP_VALUE_SYMBOL:
+            return x->symbol == y->symbol;
+        case LISP_VALUE_FUNCTION:
+            if (lisp_value_is_builtin(x) || lisp_value_is_builtin(y)) {
+                return lisp_value_is_builtin(x) && lisp_value_is_builtin(y) &&
+                       x->builtin == y->builtin;
+            }
+            lisp_value_push_pending(x->formals);
+            lisp_value_push_pending(y->formals);
+            lisp_value_push_pending(x->body);
+            lisp_value_push_pending(y->body);
+            return 1;
+        case LISP_VALUE_SEXPRESSION:
+        case LISP_VALUE_QEXPRESSION:
+            if (lisp_value_count(x) != lisp_value_count(y)) {
+                return 0;
+            }
+            for (size_t i = 0; i < lisp_value_count(x); i += 1) {
+                lisp_value_push_pending(x->cell[i]);
+                lisp_value_push_pending(y->cell[i]);
+            }
+            return 1;
+    }
+    return 0;
+}
+
+int lisp_value_equal(lisp_value* x, lisp_value* y) {
+    size_t base = lisp_value_pending.count;
+    int equal = lisp_value_equal_outside(x, y);
+    while (equal && lisp_value_pending.count > base) {
+        y = lisp_value_pop_pending();
+        x = lisp_value_pop_pending();
+        equal = lisp_value_equal_outside(x, y);
+    }
+    lisp_value_pending.count = base;
+    return equal;
+}
+
+/* The comparisons of any two values, with whether each is true when they
+ * are equal */
+#define LISP_EQUALITY(X)    \
+    X(equal, "==", "eq", 1) \
+    X(not_equal, "!=", "ne", 0)
+
+lisp_value* builtin_compare(lisp_environment* const environment,
+                            lisp_value* const arguments, const char* const op,
+                            const int equal) {
+    if (arguments->count != 2) {
+        lisp_value* error =
+            lisp_value_error("Function '%s' expects 2 arguments. Got %li.", op,
+                             arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    int r = lisp_value_equal(arguments->cell[0], arguments->cell[1]) == equal;
+    lisp_value_delete(arguments);
+    return lisp_value_number(r);
+}
+
+#define X(name, symbol, word, equal)                                   \
+    lisp_value* builtin_##name(lisp_environment* const environment,    \
+                               lisp_value* const arguments) {          \
+        return builtin_compare(environment, arguments, symbol, equal); \
+    }
+LISP_EQUALITY(X)
+#undef X
+
+/* Check the arguments of 'if' and return the branch it takes, as an
+ * S-Expression to evaluate */
+lisp_value* lisp_value_if_branch(lisp_value* const arguments) {
+    if (arguments->count != 3) {
+        lisp_value* error = lisp_value_error(
+            "Function 'if' expects 3 arguments. Got %li.", arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_NUMBER) {
+        lisp_value* error = lisp_value_error(
+            "Function 'if' expects a Number for its first argument. Got '%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[1]) != LISP_VALUE_QEXPRESSION) {
+        lisp_value* error = lisp_value_error(
+            "Function 'if' expects a Q-Expression for its second argument. Got "
+            "'%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[1])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[2]) != LISP_VALUE_QEXPRESSION) {
+        lisp_value* error = lisp_value_error(
+            "Function 'if' expects a Q-Expression for its third argument. Got "
+            "'%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[2])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+
+    lisp_value* x = lisp_value_retype(
+        lisp_value_pop(arguments,
+                       lisp_value_get_number(arguments->cell[0]) ? 1 : 2),
+        LISP_VALUE_SEXPRESSION);
+    lisp_value_delete(arguments);
+    return x;
+}
+
+lisp_value* builtin_if(lisp_environment* const environment,
+                       lisp_value* const arguments) {
+    lisp_value* x = lisp_value_if_branch(arguments);
+    if (lisp_value_type(x) == LISP_VALUE_ERROR) {
+        return x;
+    }
+    return lisp_value_evaluate(environment, x);
+}
+
+/* With --quiet the values of top-level forms are not shown, and errors are
+ * shown on stderr instead of among them. Either way they are counted, for
+ * the exit status. */
+bool lisp_load_quiet = false;
+size_t lisp_load_errors = 0;
+
+/* Evaluate a top-level form of a file being loaded and show its value. An
+ * Error is shown once, with where the form is if it came from "reader". */
+void lisp_load_evaluate(lisp_environment* const environment,
+                        lisp_value* const form, lisp_reader* const reader) {
+    lisp_value* x = lisp_value_evaluate(environment, form);
+    if (lisp_value_type(x) != LISP_VALUE_ERROR) {
+        if (!lisp_load_quiet) {
+            lisp_value_println(x);
+        }
+    } else {
+        lisp_load_errors += 1;
+        FILE* output = lisp_load_quiet ? stderr : stdout;
+        if (reader == NULL) {
+            fprintf(output, "Error: %s\n", x->error);
+        } else {
+            fprintf(output, "%s:%zu: error: %s (in the form at offset %zu)\n",
+                    reader->name, lisp_reader_line(reader, reader->form),
+                    x->error, reader->form);
+        }
+    }
+    lisp_value_delete(x);
+}
+
+/* Read a form of "reader", evaluate it and let it go before reading the
+ * next, so only the form being evaluated is held in memory */
+void lisp_load_stream(lisp_environment* const environment,
+                      lisp_reader* const reader) {
+    lisp_value* form;
+    while ((form = lisp_reader_next(reader)) != NULL) {
+        lisp_evaluation_begin();
+        lisp_load_evaluate(environment, form, reader);
+        lisp_evaluation_end();
+    }
+}
+
+/* Evaluate the forms of "reader" in order, reading them a round of chunks at
+ * a time on threads */
+void lisp_load_rounds(lisp_environment* const environment,
+                      lisp_reader* const reader) {
+    lisp_read_chunk* chunks =
+        malloc(sizeof(lisp_read_chunk) * lisp_read_threads);
+    while (reader->error == NULL && reader->offset < reader->length) {
+        size_t round = lisp_read_round(reader, chunks, lisp_read_threads);
+        /* Collections may run between forms, so keep the rest alive */
+        size_t roots = 0;
+        for (size_t i = 0; i < round; i += 1) {
+            for (size_t j = 0; j < chunks[i].count; j += 1) {
+                lisp_gc_push_root(&chunks[i].forms[j]);
+                roots += 1;
+            }
+        }
+        for (size_t i = 0; i < round; i += 1) {
+            lisp_read_chunk* chunk = &chunks[i];
+            for (size_t j = 0; j < chunk->count; j += 1) {
+                lisp_value* form = chunk->forms[j];
+                chunk->forms[j] = NULL;
+                if (reader->error != NULL) {
+                    lisp_value_delete(form);
+                    continue;
+                }
+                reader->form = chunk->offsets[j];
+                lisp_evaluation_begin();
+                lisp_load_evaluate(environment, form, reader);
+                lisp_evaluation_end();
+            }
+            if (reader->error == NULL) {
+                reader->error = chunk->error;
+            } else if (chunk->error != NULL) {
+                lisp_value_delete(chunk->error);
+            }
+        }
+        for (size_t i = 0; i < roots; i += 1) {
+            lisp_gc_pop_root();
+        }
+        for (size_t i = 0; i < round; i += 1) {
+            lisp_read_chunk_free(&chunks[i]);
+        }
+    }
+    free(chunks);
+}
+
+/*
+ * Files that 'load' reads over and over, such as libraries, are parsed once.
+ * The forms of each file are kept for the rest of the run under its name,
+ * and saved beside it as __lispcache__/NAME.fasl for the next run, both keyed
+ * by a hash of the text, which is checked every time it is loaded. Either is
+ * held as {hash {forms} {offsets}}, where the offsets say where each form
+ * starts for the errors. Larger files are streamed as before.
+ */
+#ifndef LISP_LOAD_CACHE_LIMIT
+#define LISP_LOAD_CACHE_LIMIT (1 << 20)
+#endif
+
+lisp_value* lisp_fasl_save(const char* const name,
+                           const lisp_value* const value);
+lisp_value* lisp_fasl_load(const char* const name);
+
+typedef struct lisp_load_entry {
+    char* name;
+    uint64_t hash;
+    lisp_value* forms;
+    struct lisp_load_entry* next;
+} lisp_load_entry;
+
+typedef struct {
+    size_t memory_hits;
+    size_t disk_hits;
+    size_t misses;
+} lisp_load_statistics;
+
+lisp_load_entry* lisp_load_entries = NULL;
+lisp_load_statistics lisp_load_stats;
+bool lisp_load_disk_cache = true;
+
+uint64_t lisp_load_hash(const char* const text, const size_t length) {
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i += 1) {
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211u;
+    }
+    return hash;
+}
+
+/* "dir/name" is cached in "dir/__lispcache__/name.fasl" */
+char* lisp_load_cache_name(const char* const name, const bool directory) {
+    const char* slash = strrchr(name, '/');
+    size_t base = slash == NULL ? 0 : slash - name + 1;
+    size_t size = strlen(name) + sizeof("__lispcache__/.fasl");
+    char* cache_name = malloc(size);
+    if (directory) {
+        snprintf(cache_name, size, "%.*s__lispcache__", (int)base, name);
+    } else {
+        snprintf(cache_name, size, "%.*s__lispcache__/%s.fasl", (int)base,
+                 name, name + base);
+    }
+    return cache_name;
+}
+
+/* Whether "x" is a cache of a file whose text hashes to "hash" */
+bool lisp_load_cache_valid(const lisp_value* const x, const uint64_t hash) {
+    if (lisp_value_type(x) != LISP_VALUE_QEXPRESSION ||
+        lisp_value_count(x) != 3 ||
+        lisp_value_type(x->cell[0]) != LISP_VALUE_NUMBER ||
+        (uint64_t)lisp_value_get_number(x->cell[0]) != hash ||
+        lisp_value_type(x->cell[1]) != LISP_VALUE_QEXPRESSION ||
+        lisp_value_type(x->cell[2]) != LISP_VALUE_QEXPRESSION ||
+        lisp_value_count(x->cell[1]) != lisp_value_count(x->cell[2])) {
+        return false;
+    }
+    for (size_t i = 0; i < lisp_value_count(x->cell[2]); i += 1) {
+        if (lisp_value_type(x->cell[2]->cell[i]) != LISP_VALUE_NUMBER) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The forms saved for "name" if its text still hashes to "hash", or NULL */
+lisp_value* lisp_load_cache_read(const char* const name, const uint64_t hash) {
+    char* cache_name = lisp_load_cache_name(name, false);
+    lisp_value* x = NULL;
+    if (access(cache_name, R_OK) == 0) {
+        x = lisp_fasl_load(cache_name);
+        if (!lisp_load_cache_valid(x, hash)) {
+            lisp_value_delete(x);
+            x = NULL;
+        }
+    }
+    free(cache_name);
+    return x;
+}
+
+/* Save the forms of "name" for the next run. The cache is only a help, so
+ * if it cannot be written, as in a directory we may not write to, it isn't.
+ * It is written aside and renamed into place so that a run loading the same
+ * file never sees half of it. */
+void lisp_load_cache_write(const char* const name,
+                           const lisp_value* const forms) {
+    char* directory = lisp_load_cache_name(name, true);
+    mkdir(directory, 0777);
+    free(directory);
+    char* cache_name = lisp_load_cache_name(name, false);
+    size_t size = strlen(cache_name) + 24;
+    char* temporary = malloc(size);
+    snprintf(temporary, size, "%s.%ld", cache_name, (long)getpid());
+    lisp_value* saved = lisp_fasl_save(temporary, forms);
+    if (lisp_value_type(saved) == LISP_VALUE_ERROR ||
+        rename(temporary, cache_name) != 0) {
+        remove(temporary);
+    }
+    lisp_value_delete(saved);
+    free(temporary);
+    free(cache_name);
+}
+
+/* Read all the forms of "reader" into {hash {forms} {offsets}}. If it fails
+ * part way, the forms before the failure are there to be evaluated. */
+lisp_value* lisp_load_parse(lisp_reader* const reader, const uint64_t hash) {
+    lisp_value** forms = NULL;
+    lisp_value** offsets = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    lisp_value* form;
+    while ((form = lisp_reader_next(reader)) != NULL) {
+        if (count == capacity) {
+            capacity = capacity * 2 + 16;
+            forms = realloc(forms, sizeof(lisp_value*) * capacity);
+            offsets = realloc(offsets, sizeof(lisp_value*) * capacity);
+        }
+        forms[count] = form;
+        offsets[count] = lisp_value_number(reader->form);
+        count += 1;
+    }
+    lisp_value* cells[3] = {
+        lisp_value_number(hash),
+        lisp_read_expression(forms, count, LISP_VALUE_QEXPRESSION),
+        lisp_read_expression(offsets, count, LISP_VALUE_QEXPRESSION)};
+    free(forms);
+    free(offsets);
+    return lisp_read_expression(cells, 3, LISP_VALUE_QEXPRESSION);
+}
+
+/* Keep "forms" as what "name" holds for the rest of the run */
+lisp_load_entry* lisp_load_keep(const char* const name,
+                                lisp_value* const forms) {
+    lisp_load_entry* entry = lisp_load_entries;
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    if (entry == NULL) {
+        entry = malloc(sizeof(lisp_load_entry));
+        entry->name = malloc(strlen(name) + 1);
+        strcpy(entry->name, name);
+        entry->forms = NULL;
+        entry->next = lisp_load_entries;
+        lisp_load_entries = entry;
+        lisp_gc_keep_root(&entry->forms);
+    }
+    if (entry->forms != NULL) {
+        lisp_value_delete(entry->forms);
+    }
+    entry->forms = lisp_value_promote(lisp_heap_long_lived(), forms);
+    lisp_value_delete(forms);
+    entry->hash = (uint64_t)lisp_value_get_number(entry->forms->cell[0]);
+    return entry;
+}
+
+/* Evaluate in turn the forms held in "*forms", a root. Collections between
+ * forms may move it, and a form may even load the file again, so it is
+ * looked at afresh each time. */
+void lisp_load_forms(lisp_environment* const environment,
+                     lisp_reader* const reader, lisp_value** const forms) {
+    for (size_t i = 0; i < lisp_value_count((*forms)->cell[1]); i += 1) {
+        reader->form = lisp_value_get_number((*forms)->cell[2]->cell[i]);
+        lisp_value* form = lisp_value_retain((*forms)->cell[1]->cell[i]);
+        lisp_evaluation_begin();
+        lisp_load_evaluate(environment, form, reader);
+        lisp_evaluation_end();
+    }
+}
+
+/* Evaluate the forms of "reader", parsing them only if they are not already
+ * held for its text, here or on disk */
+void lisp_load_cached(lisp_environment* const environment,
+                      lisp_reader* const reader) {
+    uint64_t hash = lisp_load_hash(reader->text, reader->length);
+    lisp_load_entry* entry = lisp_load_entries;
+    while (entry != NULL && strcmp(entry->name, reader->name) != 0) {
+        entry = entry->next;
+    }
+    if (entry != NULL && entry->hash == hash) {
+        lisp_load_stats.memory_hits += 1;
+        lisp_load_forms(environment, reader, &entry->forms);
+        return;
+    }
+    lisp_value* forms = lisp_load_disk_cache
+                            ? lisp_load_cache_read(reader->name, hash)
+                            : NULL;
+    if (forms != NULL) {
+        lisp_load_stats.disk_hits += 1;
+    } else {
+        lisp_load_stats.misses += 1;
+        forms = lisp_load_parse(reader, hash);
+        if (reader->error != NULL) {
+            /* Run what there is, but don't keep it */
+            lisp_gc_push_root(&forms);
+            lisp_load_forms(environment, reader, &forms);
+            lisp_gc_pop_root();
+            lisp_value_delete(forms);
+            return;
+        }
+        if (lisp_load_disk_cache) {
+            lisp_load_cache_write(reader->name, forms);
+        }
+    }
+    entry = lisp_load_keep(reader->name, forms);
+    lisp_load_forms(environment, reader, &entry->forms);
+}
+
+lisp_value* builtin_load(lisp_environment* const environment,
+                         lisp_value* const arguments) {
+    if (arguments->count != 1) {
+        lisp_value* error = lisp_value_error(
+            "Function 'load' expects 1 argument. Got %li.", arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_STRING) {
+        lisp_value* error = lisp_value_error(
+            "Function 'load' expects a String for its first argument. Got "
+            "'%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    /* Collections may run between forms, so keep what we hold alive */
+    lisp_value* load_arguments = arguments;
+    lisp_gc_push_root(&load_arguments);
+    const char* name = arguments->cell[0]->string;
+    lisp_value* failure = NULL;
+
+    if (lisp_reader_mpc) {
+        /* The mpc reader only reads whole files */
+        lisp_value* expression = lisp_read_file(name);
+        if (lisp_value_type(expression) != LISP_VALUE_ERROR) {
+            lisp_gc_push_root(&expression);
+            while (lisp_value_count(expression) > 0) {
+                lisp_evaluation_begin();
+                lisp_load_evaluate(environment, lisp_value_pop(expression, 0),
+                                   NULL);
+                lisp_evaluation_end();
+            }
+            lisp_gc_pop_root();
+            lisp_value_delete(expression);
+        } else {
+            failure = expression;
+        }
+    } else {
+        /* Small files are kept once parsed, and larger ones streamed */
+        lisp_source source;
+        if (lisp_source_open(&source, name)) {
+            lisp_reader reader;
+            lisp_reader_init(&reader, name, source.text, source.length);
+            if (source.length <= LISP_LOAD_CACHE_LIMIT) {
+                lisp_load_cached(environment, &reader);
+            } else if (lisp_read_threads > 1) {
+                lisp_load_rounds(environment, &reader);
+            } else {
+                lisp_load_stream(environment, &reader);
+            }
+            failure = reader.error;
+            reader.error = NULL;
+            lisp_reader_free(&reader);
+            lisp_source_close(&source);
+        } else {
+            failure = lisp_value_error("%s: error: Unable to open file!", name);
+        }
+    }
+
+    lisp_gc_pop_root();
+    lisp_value_delete(load_arguments);
+    if (failure != NULL) {
+        lisp_value* error =
+            lisp_value_error("Could not load library %s", failure->error);
+        lisp_value_delete(failure);
+        return error;
+    }
+    return lisp_value_sexpression();
+}
+
+/* Count and show the Error that stopped a load, if "x" is one */
+void lisp_load_finish(lisp_value* const x) {
+    if (lisp_value_type(x) == LISP_VALUE_ERROR) {
+        lisp_load_errors += 1;
+        fprintf(lisp_load_quiet ? stderr : stdout, "Error: %s\n", x->error);
+    }
+    lisp_value_delete(x);
+}
+
+/* Evaluate program text that isn't in a file, as -e and - give it, returning
+ * () or the Error that stopped it being read */
+lisp_value* lisp_load_text(lisp_environment* const environment,
+                           const char* const name, const char* const text,
+                           const size_t length) {
+    lisp_reader reader;
+    lisp_reader_init(&reader, name, text, length);
+    lisp_load_stream(environment, &reader);
+    lisp_value* failure = reader.error;
+    reader.error = NULL;
+    lisp_reader_free(&reader);
+    return failure != NULL ? failure : lisp_value_sexpression();
+}
+
+/* Values saved with save-value and read back with load-value, in a binary
+ * form that is read in one pass with nothing to scan: a header, then each
+ * value as a tag byte followed by what it holds. Lengths, counts and numbers
+ * are LEB128 varints, with numbers zigzag encoded so that small negative
+ * ones stay short. A symbol is written by name the first time it is met and
+ * by index after that. A lambda is its formals, its body and the bindings it
+ * has been partially applied to, and a builtin is the name it has in the
+ * global environment. */
+#define LISP_FASL_MAGIC "LFASL1\n"
+#define LISP_FASL_MAGIC_SIZE (sizeof(LISP_FASL_MAGIC) - 1)
+
+enum {
+    LISP_FASL_NUMBER,
+    LISP_FASL_STRING,
+    LISP_FASL_ERROR,
+    LISP_FASL_SYMBOL,       /* A name not written before */
+    LISP_FASL_SYMBOL_AGAIN, /* The index of a name that was */
+    LISP_FASL_SEXPRESSION,
+    LISP_FASL_QEXPRESSION,
+    LISP_FASL_LAMBDA, /* With the count of its bindings */
+    LISP_FASL_BUILTIN
+};
+
+typedef struct {
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+    /* Open addressing from the interned names written so far to their
+     * index */
+    char** names;
+    size_t* indices;
+    size_t name_count;
+    size_t name_capacity;
+} lisp_fasl_writer;
+
+void lisp_fasl_put_byte(lisp_fasl_writer* const writer,
+                        const unsigned char byte) {
+    if (writer->length == writer->capacity) {
+        writer->capacity = writer->capacity * 2 + 4096;
+        writer->data = realloc(writer->data, writer->capacity);
+    }
+    writer->data[writer->length] = byte;
+    writer->length += 1;
+}
+
+void lisp_fasl_put_varint(lisp_fasl_writer* const writer, uint64_t x) {
+    while (x >= 0x80) {
+        lisp_fasl_put_byte(writer, (unsigned char)(x | 0x80));
+        x >>= 7;
+    }
+    lisp_fasl_put_byte(writer, (unsigned char)x);
+}
+
+void lisp_fasl_put_text(lisp_fasl_writer* const writer,
+                        const unsigned char tag, const char* const text) {
+    size_t length = strlen(text);
+    lisp_fasl_put_byte(writer, tag);
+    lisp_fasl_put_varint(writer, length);
+    for (size_t i = 0; i < length; i += 1) {
+        lisp_fasl_put_byte(writer, (unsigned char)text[i]);
+    }
+}
+
+size_t lisp_fasl_name_hash(const char* const name) {
+    return (size_t)(((uintptr_t)name >> 3) * 0x9E3779B97F4A7C15u);
+}
+
+void lisp_fasl_put_symbol(lisp_fasl_writer* const writer, char* const name) {
+    if ((writer->name_count + 1) * 2 > writer->name_capacity) {
+        size_t capacity =
+            writer->name_capacity == 0 ? 256 : writer->name_capacity * 2;
+        char** names = calloc(capacity, sizeof(char*));
+        size_t* indices = malloc(sizeof(size_t) * capacity);
+        for (size_t i = 0; i < writer->name_capacity; i += 1) {
+            if (writer->names[i] == NULL) {
+                continue;
+            }
+            size_t j = lisp_fasl_name_hash(writer->names[i]) & (capacity - 1);
+            while (names[j] != NULL) {
+                j = (j + 1) & (capacity - 1);
+            }
+            names[j] = writer->names[i];
+            indices[j] = writer->indices[i];
+        }
+        free(writer->names);
+        free(writer->indices);
+        writer->names = names;
+        writer->indices = indices;
+        writer->name_capacity = capacity;
+    }
+    size_t mask = writer->name_capacity - 1;
+    size_t i = lisp_fasl_name_hash(name) & mask;
+    while (writer->names[i] != NULL) {
+        if (writer->names[i] == name) {
+            lisp_fasl_put_byte(writer, LISP_FASL_SYMBOL_AGAIN);
+            lisp_fasl_put_varint(writer, writer->indices[i]);
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    writer->names[i] = name;
+    writer->indices[i] = writer->name_count;
+    writer->name_count += 1;
+    lisp_fasl_put_text(writer, LISP_FASL_SYMBOL, name);
+}
+
+/* The name "builtin" is bound to in the global environment, or NULL */
+char* lisp_fasl_builtin_name(const lisp_builtin builtin) {
+    const lisp_environment* global = lisp_gc_environment;
+    for (size_t i = 0; global != NULL && i < global->count; i += 1) {
+        const lisp_value* value = global->values[i];
+        if (lisp_value_type(value) == LISP_VALUE_FUNCTION &&
+            lisp_value_is_builtin(value) && value->builtin == builtin) {
+            return global->symbols[i];
+        }
+    }
+    return NULL;
+}
+
+/* Write "value" if it has no parts, or what comes before them if it does and
+ * start on them. Returns an error message if it cannot be written. */
+const char* lisp_fasl_put_opening(lisp_fasl_writer* const writer,
+                                  const lisp_value* const value) {
+    switch (lisp_value_type(value)) {
+        case LISP_VALUE_NUMBER: {
+            long x = lisp_value_get_number(value);
+            lisp_fasl_put_byte(writer, LISP_FASL_NUMBER);
+            lisp_fasl_put_varint(writer, ((uint64_t)x << 1) ^
+                                             (uint64_t)(x < 0 ? -1 : 0));
+            return NULL;
+        }
+        case LISP_VALUE_STRING:
+            lisp_fasl_put_text(writer, LISP_FASL_STRING, value->string);
+            return NULL;
+        case LISP_VALUE_ERROR:
+            lisp_fasl_put_text(writer, LISP_FASL_ERROR, value->error);
+            return NULL;
+        case LISP_VALUE_SYMBOL:
+            lisp_fasl_put_symbol(writer, value->symbol);
+            return NULL;
+        case LISP_VALUE_SEXPRESSION:
+        case LISP_VALUE_QEXPRESSION: {
+            size_t count = lisp_value_count(value);
+            lisp_fasl_put_byte(writer,
+                               lisp_value_type(value) == LISP_VALUE_SEXPRESSION
+                                   ? LISP_FASL_SEXPRESSION
+                                   : LISP_FASL_QEXPRESSION);
+            lisp_fasl_put_varint(writer, count);
+            if (count > 0) {
+                lisp_walk_enter(value);
+            }
+            return NULL;
+        }
+        case LISP_VALUE_FUNCTION: {
+            if (lisp_value_is_builtin(value)) {
+                char* name = lisp_fasl_builtin_name(value->builtin);
+                if (name == NULL) {
+                    return "Cannot save a builtin with no global name.";
+                }
+                lisp_fasl_put_text(writer, LISP_FASL_BUILTIN, name);
+                return NULL;
+            }
+            lisp_fasl_put_byte(writer, LISP_FASL_LAMBDA);
+            lisp_fasl_put_varint(writer, value->environment->count);
+            lisp_walk_enter(value);
+            return NULL;
+        }
+    }
+    return "Cannot save a value of unknown type.";
+}
+
+/* Write "value", returning an error message if it cannot be. The parts of a
+ * lambda are its formals, its body, and the name and value of each binding. */
+const char* lisp_fasl_put(lisp_fasl_writer* const writer,
+                          const lisp_value* const value) {
+    size_t base = lisp_walk_stack.count;
+    const char* error = lisp_fasl_put_opening(writer, value);
+    while (error == NULL && lisp_walk_stack.count > base) {
+        lisp_walk_frame* frame = lisp_walk_top();
+        const lisp_value* x = frame->value;
+        const lisp_value* part;
+        if (lisp_value_type(x) == LISP_VALUE_FUNCTION) {
+            const lisp_environment* bindings = x->environment;
+            if (frame->next == bindings->count + 2) {
+                lisp_walk_stack.count -= 1;
+                continue;
+            }
+            if (frame->next < 2) {
+                part = frame->next == 0 ? x->formals : x->body;
+            } else {
+                lisp_fasl_put_symbol(writer,
+                                     bindings->symbols[frame->next - 2]);
+                part = bindings->values[frame->next - 2];
+            }
+        } else {
+            if (frame->next == x->count) {
+                lisp_walk_stack.count -= 1;
+                continue;
+            }
+            part = x->cell[frame->next];
+        }
+        frame->next += 1;
+        error = lisp_fasl_put_opening(writer, part);
+    }
+    lisp_walk_stack.count = base;
+    return error;
+}
+
+/* The bytes of "value", with how many there are in "length", or NULL with
+ * why in "error". The bytes are the caller's to free. */
+unsigned char* lisp_fasl_encode(const lisp_value* const value,
+                                size_t* const length,
+                                const char** const error) {
+    lisp_fasl_writer writer = {NULL, 0, 0, NULL, NULL, 0, 0};
+    for (size_t i = 0; i < LISP_FASL_MAGIC_SIZE; i += 1) {
+        lisp_fasl_put_byte(&writer, (unsigned char)LISP_FASL_MAGIC[i]);
+    }
+    *error = lisp_fasl_put(&writer, value);
+    free(writer.names);
+    free(writer.indices);
+    if (*error != NULL) {
+        free(writer.data);
+        return NULL;
+    }
+    *length = writer.length;
+    return writer.data;
+}
+
+/* An expression or lambda being read: where its parts start on the value
+ * stack, and how many are still to come */
+typedef struct {
+    unsigned char tag;
+    size_t first;
+    size_t remaining;
+} lisp_fasl_open;
+
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    size_t offset;
+    const char* failure; /* Why reading stopped, if it did */
+    char** names;
+    size_t name_count;
+    size_t name_capacity;
+    lisp_value** values;
+    size_t value_count;
+    size_t value_capacity;
+    lisp_fasl_open* opens;
+    size_t open_count;
+    size_t open_capacity;
+} lisp_fasl_reader;
+
+bool lisp_fasl_get_varint(lisp_fasl_reader* const reader, uint64_t* const x) {
+    *x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (reader->offset == reader->length) {
+            reader->failure = "the data ends in the middle of a value";
+            return false;
+        }
+        unsigned char byte = reader->data[reader->offset];
+        reader->offset += 1;
+        *x |= (uint64_t)(byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            return true;
+        }
+    }
+    reader->failure = "a number is too long";
+    return false;
+}
+
+/* A count or length, which cannot be more than the bytes that are left as
+ * everything it counts takes at least one */
+bool lisp_fasl_get_count(lisp_fasl_reader* const reader,
+                         size_t* const count) {
+    uint64_t x;
+    if (!lisp_fasl_get_varint(reader, &x)) {
+        return false;
+    }
+    if (x > reader->length - reader->offset) {
+        reader->failure = "the data ends in the middle of a value";
+        return false;
+    }
+    *count = x;
+    return true;
+}
+
+/* A String or Error of the text that comes next */
+lisp_value* lisp_fasl_get_text(lisp_fasl_reader* const reader,
+                               const int type) {
+    size_t length;
+    if (!lisp_fasl_get_count(reader, &length)) {
+        return NULL;
+    }
+    const char* text = (const char*)reader->data + reader->offset;
+    if (memchr(text, '\0', length) != NULL) {
+        reader->failure = "a string holds a NUL";
+        return NULL;
+    }
+    reader->offset += length;
+    lisp_value* x = lisp_value_allocate();
+    x->type = type;
+    x->references = 1;
+    x->string = lisp_value_text(x, length + 1);
+    memcpy(x->string, text, length);
+    x->string[length] = '\0';
+    return x;
+}
+
+lisp_value* lisp_fasl_get_symbol(lisp_fasl_reader* const reader,
+                                 const unsigned char tag) {
+    if (tag == LISP_FASL_SYMBOL_AGAIN) {
+        uint64_t index;
+        if (!lisp_fasl_get_varint(reader, &index)) {
+            return NULL;
+        }
+        if (index >= reader->name_count) {
+            reader->failure = "a symbol refers to a name not yet read";
+            return NULL;
+        }
+        return lisp_value_symbol_interned(reader->names[index]);
+    }
+    size_t length;
+    if (!lisp_fasl_get_count(reader, &length)) {
+        return NULL;
+    }
+    char* name = lisp_symbol_intern_text(
+        (const char*)reader->data + reader->offset, length);
+    reader->offset += length;
+    if (reader->name_count == reader->name_capacity) {
+        reader->name_capacity = reader->name_capacity * 2 + 64;
+        reader->names =
+            realloc(reader->names, sizeof(char*) * reader->name_capacity);
+    }
+    reader->names[reader->name_count] = name;
+    reader->name_count += 1;
+    return lisp_value_symbol_interned(name);
+}
+
+lisp_value* lisp_fasl_get_builtin(lisp_fasl_reader* const reader) {
+    size_t length;
+    if (!lisp_fasl_get_count(reader, &length)) {
+        return NULL;
+    }
+    lisp_value* key = lisp_value_symbol_text(
+        (const char*)reader->data + reader->offset, length);
+    reader->offset += length;
+    lisp_value* x = lisp_gc_environment == NULL
+                        ? lisp_value_error("No global environment.")
+                        : lisp_environment_get(lisp_gc_environment, key);
+    lisp_value_delete(key);
+    if (lisp_value_type(x) != LISP_VALUE_FUNCTION ||
+        !lisp_value_is_builtin(x)) {
+        lisp_value_delete(x);
+        reader->failure = "a builtin is not bound to its name";
+        return NULL;
+    }
+    return x;
+}
+
+/* The lambda whose formals, body and bindings are the "count" values at
+ * "parts" */
+lisp_value* lisp_fasl_lambda(lisp_fasl_reader* const reader,
+                             lisp_value** const parts, const size_t count) {
+    bool valid = lisp_value_type(parts[0]) == LISP_VALUE_QEXPRESSION &&
+                 lisp_value_type(parts[1]) == LISP_VALUE_QEXPRESSION;
+    /* Binding takes the formals to be symbols, as '\' makes sure */
+    for (size_t i = 0; valid && i < lisp_value_count(parts[0]); i += 1) {
+        valid = lisp_value_type(parts[0]->cell[i]) == LISP_VALUE_SYMBOL;
+    }
+    for (size_t i = 2; i < count; i += 2) {
+        valid = valid && lisp_value_type(parts[i]) == LISP_VALUE_SYMBOL;
+    }
+    if (!valid) {
+        reader->failure = "a lambda is malformed";
+        for (size_t i = 0; i < count; i += 1) {
+            lisp_value_delete(parts[i]);
+        }
+        return NULL;
+    }
+    lisp_value* x = lisp_value_lambda(parts[0], parts[1]);
+    for (size_t i = 2; i < count; i += 2) {
+        lisp_environment_put(x->environment, parts[i], parts[i + 1]);
+        lisp_value_delete(parts[i]);
+        lisp_value_delete(parts[i + 1]);
+    }
+    return x;
+}
+
+/* Read the next value, with no more than its first byte if it has parts */
+lisp_value* lisp_fasl_get(lisp_fasl_reader* const reader) {
+    if (reader->offset == reader->length) {
+        reader->failure = "the data ends in the middle of a value";
+        return NULL;
+    }
+    unsigned char tag = reader->data[reader->offset];
+    reader->offset += 1;
+    size_t count;
+    switch (tag) {
+        case LISP_FASL_NUMBER: {
+            uint64_t x;
+            if (!lisp_fasl_get_varint(reader, &x)) {
+                return NULL;
+            }
+            return lisp_value_number((long)(x >> 1) ^ -(long)(x & 1));
+        }
+        case LISP_FASL_STRING:
+            return lisp_fasl_get_text(reader, LISP_VALUE_STRING);
+        case LISP_FASL_ERROR:
+            return lisp_fasl_get_text(reader, LISP_VALUE_ERROR);
+        case LISP_FASL_SYMBOL:
+        case LISP_FASL_SYMBOL_AGAIN:
+            return lisp_fasl_get_symbol(reader, tag);
+        case LISP_FASL_BUILTIN:
+            return lisp_fasl_get_builtin(reader);
+        case LISP_FASL_SEXPRESSION:
+        case LISP_FASL_QEXPRESSION:
+        case LISP_FASL_LAMBDA:
+            if (!lisp_fasl_get_count(reader, &count)) {
+                return NULL;
+            }
+            if (tag == LISP_FASL_LAMBDA) {
+                count = count * 2 + 2;
+            } else if (count == 0) {
+                return tag == LISP_FASL_SEXPRESSION ? lisp_value_sexpression()
+                                                    : lisp_value_qexpression();
+            }
+            if (reader->open_count == reader->open_capacity) {
+                reader->open_capacity = reader->open_capacity * 2 + 16;
+                reader->opens =
+                    realloc(reader->opens,
+                            sizeof(lisp_fasl_open) * reader->open_capacity);
+            }
+            lisp_fasl_open* open = &reader->opens[reader->open_count];
+            open->tag = tag;
+            open->first = reader->value_count;
+            open->remaining = count;
+            reader->open_count += 1;
+            return NULL;
+        default:
+            reader->failure = "a value has an unknown tag";
+            return NULL;
+    }
+}
+
+/* Read back the value written as the "length" bytes at "data" by
+ * lisp_fasl_encode, or return an Error saying where they went wrong. "name"
+ * is where they came from. As with the reader, nested values are kept on
+ * stacks of our own rather than the C stack. */
+lisp_value* lisp_fasl_decode(const char* const name,
+                             const unsigned char* const data,
+                             const size_t length) {
+    if (length < LISP_FASL_MAGIC_SIZE ||
+        memcmp(data, LISP_FASL_MAGIC, LISP_FASL_MAGIC_SIZE) != 0) {
+        return lisp_value_error("%s: error: not a saved value", name);
+    }
+    lisp_fasl_reader reader = {data, length, LISP_FASL_MAGIC_SIZE, NULL};
+    lisp_value* result = NULL;
+    while (result == NULL && reader.failure == NULL) {
+        lisp_value* x = lisp_fasl_get(&reader);
+        if (x == NULL) {
+            continue;
+        }
+        /* Put the value into the expressions it completes */
+        while (reader.open_count > 0) {
+            lisp_fasl_open* open = &reader.opens[reader.open_count - 1];
+            if (reader.value_count == reader.value_capacity) {
+                reader.value_capacity = reader.value_capacity * 2 + 64;
+                reader.values = realloc(
+                    reader.values, sizeof(lisp_value*) * reader.value_capacity);
+            }
+            reader.values[reader.value_count] = x;
+            reader.value_count += 1;
+            open->remaining -= 1;
+            if (open->remaining > 0) {
+                x = NULL;
+                break;
+            }
+            size_t count = reader.value_count - open->first;
+            lisp_value** parts = &reader.values[open->first];
+            reader.value_count = open->first;
+            reader.open_count -= 1;
+            if (open->tag == LISP_FASL_LAMBDA) {
+                x = lisp_fasl_lambda(&reader, parts, count);
+                if (x == NULL) {
+                    break;
+                }
+            } else {
+                x = lisp_read_expression(parts, count,
+                                         open->tag == LISP_FASL_SEXPRESSION
+                                             ? LISP_VALUE_SEXPRESSION
+                                             : LISP_VALUE_QEXPRESSION);
+            }
+        }
+        result = x;
+    }
+    if (result != NULL && reader.offset != reader.length) {
+        reader.failure = "there is more data after the value";
+        lisp_value_delete(result);
+    }
+    if (reader.failure != NULL) {
+        while (reader.value_count > 0) {
+            reader.value_count -= 1;
+            lisp_value_delete(reader.values[reader.value_count]);
+        }
+        result = lisp_value_error("%s: error: %s at byte %zu", name,
+                                  reader.failure, reader.offset);
+    }
+    free(reader.names);
+    free(reader.values);
+    free(reader.opens);
+    return result;
+}
+
+/* Save "value" to the file "name", returning () or an Error */
+lisp_value* lisp_fasl_save(const char* const name,
+                           const lisp_value* const value) {
+    size_t length;
+    const char* error;
+    unsigned char* data = lisp_fasl_encode(value, &length, &error);
+    if (data == NULL) {
+        return lisp_value_error("%s", error);
+    }
+    FILE* file = fopen(name, "wb");
+    bool written = file != NULL && fwrite(data, 1, length, file) == length;
+    if (file != NULL && fclose(file) != 0) {
+        written = false;
+    }
+    free(data);
+    if (!written) {
+        return lisp_value_error("%s: error: Unable to write file!", name);
+    }
+    return lisp_value_sexpression();
+}
+
+/* The value saved in the file "name", or an Error */
+lisp_value* lisp_fasl_load(const char* const name) {
+    lisp_source source;
+    if (!lisp_source_open(&source, name)) {
+        return lisp_value_error("%s: error: Unable to open file!", name);
+    }
+    lisp_value* x = lisp_fasl_decode(
+        name, (const unsigned char*)source.text, source.length);
+    lisp_source_close(&source);
+    return x;
+}
+
+lisp_value* builtin_save_value(lisp_environment* const environment,
+                               lisp_value* const arguments) {
+    if (arguments->count != 2) {
+        lisp_value* error = lisp_value_error(
+            "Function 'save-value' expects 2 arguments. Got %li.",
+            arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_STRING) {
+        lisp_value* error = lisp_value_error(
+            "Function 'save-value' expects a String for its first argument. "
+            "Got '%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    lisp_value* x =
+        lisp_fasl_save(arguments->cell[0]->string, arguments->cell[1]);
+    lisp_value_delete(arguments);
+    return x;
+}
+
+lisp_value* builtin_load_value(lisp_environment* const environment,
+                               lisp_value* const arguments) {
+    if (arguments->count != 1) {
+        lisp_value* error = lisp_value_error(
+            "Function 'load-value' expects 1 argument. Got %li.",
+            arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_STRING) {
+        lisp_value* error = lisp_value_error(
+            "Function 'load-value' expects a String for its first argument. "
+            "Got '%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    lisp_value* x = lisp_fasl_load(arguments->cell[0]->string);
+    lisp_value_delete(arguments);
+    return x;
+}
+
+/* "--bench-fasl FILE" reads the forms of FILE as text, saves them to
+ * FILE.fasl, and reports how long each takes to read back, best of three */
+int lisp_fasl_benchmark(const char* const name) {
+    size_t size = strlen(name) + sizeof(".fasl");
+    char* fasl_name = malloc(size);
+    snprintf(fasl_name, size, "%s.fasl", name);
+    lisp_value* forms = lisp_read_file(name);
+    lisp_value* saved = lisp_value_type(forms) == LISP_VALUE_ERROR
+                            ? lisp_value_retain(forms)
+                            : lisp_fasl_save(fasl_name, forms);
+    if (lisp_value_type(saved) == LISP_VALUE_ERROR) {
+        fprintf(stderr, "%s\n", saved->error);
+        lisp_value_delete(saved);
+        lisp_value_delete(forms);
+        free(fasl_name);
+        return 1;
+    }
+    lisp_value_delete(saved);
+    double best[2] = {0, 0};
+    bool same = true;
+    for (int round = 0; round < 3; round += 1) {
+        for (int binary = 0; binary < 2; binary += 1) {
+            struct timespec start;
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            lisp_value* x =
+                binary ? lisp_fasl_load(fasl_name) : lisp_read_file(name);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double seconds = (end.tv_sec - start.tv_sec) +
+                             (end.tv_nsec - start.tv_nsec) / 1e9;
+            if (round == 0 || seconds < best[binary]) {
+                best[binary] = seconds;
+            }
+            same = same && lisp_value_equal(x, forms);
+            lisp_value_delete(x);
+        }
+    }
+    struct stat text_status;
+    struct stat fasl_status;
+    stat(name, &text_status);
+    stat(fasl_name, &fasl_status);
+    printf("Text: %lld bytes in %.3f s\n", (long long)text_status.st_size,
+           best[0]);
+    printf("Fasl: %lld bytes in %.3f s, %.1f times as fast\n",
+           (long long)fasl_status.st_size, best[1], best[0] / best[1]);
+    if (!same) {
+        printf("The values read back differ!\n");
+    }
+    lisp_value_delete(forms);
+    free(fasl_name);
+    return same ? 0 : 1;
+}
+
+/* An image of an environment, for --dump-image and --image, is its bindings
+ * saved as one Q-Expression of names and values in turn. Builtins are saved
+ * by name, and so are linked up again with whatever the process loading the
+ * image has. */
+lisp_value* lisp_image_dump(const char* const name,
+                            const lisp_environment* const environment) {
+    size_t count = environment->count * 2;
+    lisp_value** cells = malloc(sizeof(lisp_value*) * (count + 1));
+    for (size_t i = 0; i < environment->count; i += 1) {
+        cells[i * 2] = lisp_value_symbol_interned(environment->symbols[i]);
+        cells[i * 2 + 1] = lisp_value_retain(environment->values[i]);
+    }
+    lisp_value* bindings =
+        lisp_read_expression(cells, count, LISP_VALUE_QEXPRESSION);
+    free(cells);
+    lisp_value* x = lisp_fasl_save(name, bindings);
+    lisp_value_delete(bindings);
+    return x;
+}
+
+/* Put the bindings of the image "name" into "environment", returning () or
+ * an Error. The image is decoded into new values, as load-value does, not
+ * mapped and used in place: values point at each other and at interned
+ * names by address, so a process cannot share them with another.
+ * "make bench-image" times how long starting from an image takes. */
+lisp_value* lisp_image_load(const char* const name,
+                            lisp_environment* const environment) {
+    lisp_value* bindings = lisp_fasl_load(name);
+    if (lisp_value_type(bindings) == LISP_VALUE_ERROR) {
+        return bindings;
+    }
+    size_t count = lisp_value_count(bindings);
+    bool valid = lisp_value_type(bindings) == LISP_VALUE_QEXPRESSION &&
+                 count % 2 == 0;
+    for (size_t i = 0; valid && i < count; i += 2) {
+        valid = lisp_value_type(bindings->cell[i]) == LISP_VALUE_SYMBOL;
+    }
+    if (!valid) {
+        lisp_value_delete(bindings);
+        return lisp_value_error("%s: error: not an image", name);
+    }
+    for (size_t i = 0; i < count; i += 2) {
+        lisp_environment_put(environment, bindings->cell[i],
+                             bindings->cell[i + 1]);
+    }
+    lisp_value_delete(bindings);
+    return lisp_value_sexpression();
+}
+
+/* Write "arguments" to "buffer" as 'print' shows them, apart by spaces */
+void lisp_buffer_add_arguments(lisp_buffer* const buffer,
+                               const lisp_value* const arguments) {
+    for (size_t i = 0; i < arguments->count; i += 1) {
+        if (i > 0) {
+            lisp_buffer_add_char(buffer, ' ');
+        }
+        lisp_buffer_add_value(buffer, arguments->cell[i]);
+    }
+}
+
+lisp_value* builtin_print(lisp_environment* const environment,
+                          lisp_value* const arguments) {
+    lisp_buffer_add_arguments(&lisp_output, arguments);
+    lisp_buffer_add_char(&lisp_output, '\n');
+    lisp_output_flush();
+    lisp_value_delete(arguments);
+    return lisp_value_sexpression();
+}
+
+lisp_buffer lisp_string_buffer = {NULL, 0, 0};
+
+/* What 'print' would show for the arguments, as a String */
+lisp_value* builtin_to_string(lisp_environment* const environment,
+                              lisp_value* const arguments) {
+    lisp_buffer_add_arguments(&lisp_string_buffer, arguments);
+    lisp_buffer_add_char(&lisp_string_buffer, '\0');
+    lisp_value* x = lisp_value_string(lisp_string_buffer.data);
+    lisp_string_buffer.length = 0;
+    lisp_value_delete(arguments);
+    return x;
+}
+
+lisp_value* builtin_error(lisp_environment* const environment,
+                          lisp_value* const arguments) {
+    if (arguments->count != 1) {
+        lisp_value* error = lisp_value_error(
+            "Function 'error' expects 1 argument. Got %li.", arguments->count);
+        lisp_value_delete(arguments);
+        return error;
+    }
+    if (lisp_value_type(arguments->cell[0]) != LISP_VALUE_STRING) {
+        lisp_value* error = lisp_value_error(
+            "Function 'error' expects a String for its first argument. Got "
+            "'%s'.",
+            lisp_type_name(lisp_value_type(arguments->cell[0])));
+        lisp_value_delete(arguments);
+        return error;
+    }
+    lisp_value* error = lisp_value_error(arguments->cell[0]->string);
+    lisp_value_delete(arguments);
+    return error;
+}
+
+lisp_value* lisp_value_pair(const char* const name, const long number) {
+    return lisp_value_add(
+        lisp_value_add(lisp_value_qexpression(), lisp_value_symbol(name)),
+        lisp_value_number(number));
+}
+
+/* Takes any arguments, e.g. (gc-stats ()), as a lone function in an
+ * S-Expression is not called */
+lisp_value* builtin_gc_stats(lisp_environment* const environment,
+                             lisp_value* const arguments) {
+    lisp_value_delete(arguments);
+    lisp_value* x = lisp_value_qexpression();
+    x = lisp_value_add(x, lisp_value_pair("minor-collections",
+                                          lisp_gc_stats.minor_collections));
+    x = lisp_value_add(x, lisp_value_pair("major-collections",
+                                          lisp_gc_stats.major_collections));
+    x = lisp_value_add(
+        x, lisp_value_pair("bytes-promoted", lisp_gc_stats.bytes_promoted));
+    x = lisp_value_add(
+        x, lisp_value_pair("bytes-swept", lisp_gc_stats.bytes_swept));
+    x = lisp_value_add(x,
+                       lisp_value_pair("pause-us", lisp_gc_stats.pause_total));
+    x = lisp_value_add(
+        x, lisp_value_pair("max-pause-us", lisp_gc_stats.pause_max));
+    return x;
+}
+
+/* How often 'load' found a file's forms already held, here or on disk, and
+ * how often it had to parse them */
+lisp_value* builtin_load_stats(lisp_environment* const environment,
+                               lisp_value* const arguments) {
+    lisp_value_delete(arguments);
+    lisp_value* x = lisp_value_qexpression();
+    x = lisp_value_add(
+        x, lisp_value_pair("memory-hits", lisp_load_stats.memory_hits));
+    x = lisp_value_add(x,
+                       lisp_value_pair("disk-hits", lisp_load_stats.disk_hits));
+    x = lisp_value_add(x, lisp_value_pair("misses", lisp_load_stats.misses));
+    return x;
+}
+
+lisp_value* builtin_gc(lisp_environment* const environment,
+                       lisp_value* const arguments) {
+    lisp_value_delete(arguments);
+    lisp_gc_request();
+    return lisp_value_sexpression();
+}
+
+/* Bind "arguments" to the formals of "function" in "frame". Returns NULL once
+ * every formal is bound, or else an error or the partially applied function.
+ * Takes ownership of "arguments" but not of "function". */
+lisp_value* lisp_value_bind(lisp_environment* const frame,
+                            const lisp_value* const function,
+                            lisp_value* const arguments) {
+    /* Arguments bound by an earlier partial application come first */
+    for (size_t i = 0; i < function->environment->count; i += 1) {
+        lisp_value key = {.symbol = function->environment->symbols[i]};
+        lisp_environment_put(frame, &key, function->environment->values[i]);
+    }
+
+    lisp_value* formals = function->formals;
+    size_t total = lisp_value_count(formals);
+    size_t given = arguments->count;
+    size_t next = 0;
+    for (size_t i = 0; i < given; i += 1) {
+        if (next == total) {
+            lisp_value_delete(arguments);
+            return lisp_value_error(
+                "Function passed too many arguments. Expected %li. Got %li.",
+                total, given);
+        }
+        lisp_value* symbol = formals->cell[next];
+        next += 1;
+
+        /* Special case to deal with '&' */
+        if (symbol->symbol == lisp_symbol_ampersand) {
+            if (total - next != 1) {
+                lisp_value_delete(arguments);
+                return lisp_value_error(
+                    "Function format invalid. Symbol '&' not followed by "
+                    "single symbol.");
+            }
+            lisp_value* rest = lisp_value_qexpression();
+            for (; i < given; i += 1) {
+                rest =
+                    lisp_value_add(rest, lisp_value_retain(arguments->cell[i]));
+            }
+            lisp_environment_put(frame, formals->cell[next], rest);
+            lisp_value_delete(rest);
+            next += 1;
+            break;
+        }
+        lisp_environment_put(frame, symbol, arguments->cell[i]);
+    }
+    lisp_value_delete(arguments);
+
+    /* If '&' remains in formal list, bind to empty list */
+    if (next < total && formals->cell[next]->symbol == lisp_symbol_ampersand) {
+        if (total - next != 2) {
+            return lisp_value_error(
+                "Function format invalid. Symbol '&' not followed by single "
+                "symbol.");
+        }
+        lisp_environment_put(frame, formals->cell[next + 1],
+                             lisp_value_qexpression());
+        next += 2;
+    }
+    if (next == total) {
+        return NULL;
+    }
+
+    /* Return a partially applied function: the arguments bound so far and
+     * the formals still missing, sharing the body. The frame may hold more
+     * than this function's arguments, so only those are taken from it. */
+    lisp_value* partial = lisp_value_allocate();
+    partial->type = LISP_VALUE_FUNCTION;
+    partial->references = 1;
+    partial->environment = lisp_environment_copy(function->environment);
+    partial->formals = lisp_value_qexpression();
+    partial->body = lisp_value_retain(function->body);
+    for (size_t i = 0; i < total; i += 1) {
+        if (i >= next) {
+            partial->formals = lisp_value_add(
+                partial->formals, lisp_value_retain(formals->cell[i]));
+        } else if (formals->cell[i]->symbol != lisp_symbol_ampersand) {
+            lisp_value* value = lisp_environment_get(frame, formals->cell[i]);
+            lisp_environment_put(partial->environment, formals->cell[i], value);
+            lisp_value_delete(value);
+        }
+    }
+    return partial;
+}
+
+/* The tree walker evaluates expressions as they are, without compiling them.
+ * It keeps the work it has pending on a stack of its own rather than on the C
+ * stack, so that deep recursion ends in an error instead of a crash, and the
+ * memory an evaluation can take is bounded. An "arguments" continuation is
+ * an S-Expression whose cells are being evaluated in turn. A "body"
+ * continuation is a call whose body is running in "environment", its frame;
+ * it pops the frame when the body's value comes back. The body itself is a
+ * Q-Expression whose cells are evaluated by an "arguments" continuation on
+ * top of that.
+ */
+#ifndef LISP_EVALUATION_MAX_DEPTH
+#define LISP_EVALUATION_MAX_DEPTH 1000000
+#endif
+
+enum { LISP_CONTINUATION_ARGUMENTS, LISP_CONTINUATION_BODY };
+
+typedef struct {
+    int kind;
+    lisp_environment* environment;
+    /* The cells being evaluated, and the S-Expression their values go to.
+     * That is the expression itself if nothing else holds it. Otherwise, as
+     * for a function body, the cells are read where they are, and their
+     * values go to new arguments. */
+    lisp_value* expression;
+    lisp_value* arguments;
+    size_t index; /* Cells before it are evaluated */
+    lisp_value* function; /* The function whose body is running */
+} lisp_continuation;
+
+lisp_continuation* lisp_continuations = NULL;
+size_t lisp_continuation_count = 0;
+size_t lisp_continuation_capacity = 0;
+size_t lisp_evaluation_max_depth = LISP_EVALUATION_MAX_DEPTH;
+
+lisp_continuation* lisp_continuation_push(const int kind,
+                                          lisp_environment* const environment) {
+    if (lisp_continuation_count == lisp_evaluation_max_depth) {
+        return NULL;
+    }
+    if (lisp_continuation_count == lisp_continuation_capacity) {
+        lisp_continuation_capacity = lisp_continuation_capacity * 2 + 64;
+        lisp_continuations =
+            realloc(lisp_continuations,
+                    sizeof(lisp_continuation) * lisp_continuation_capacity);
+    }
+    lisp_continuation* continuation =
+        &lisp_continuations[lisp_continuation_count];
+    lisp_continuation_count += 1;
+    continuation->kind = kind;
+    continuation->environment = environment;
+    continuation->expression = NULL;
+    continuation->arguments = NULL;
+    continuation->index = 0;
+    continuation->function = NULL;
+    return continuation;
+}
+
+/* An S-Expression with room for "capacity" cells, to fill in order */
+lisp_value* lisp_value_arguments_new(const size_t capacity) {
+    lisp_value* x = lisp_value_allocate();
+    x->type = LISP_VALUE_SEXPRESSION;
+    x->references = 1;
+    x->count = 0;
+    x->cell = lisp_allocate(sizeof(lisp_value*) * capacity);
+    x->code = NULL;
+    return x;
+}
+
+lisp_value* lisp_evaluation_too_deep() {
+    return lisp_value_error("Maximum evaluation depth of %zu exceeded.",
+                            lisp_evaluation_max_depth);
+}
+
+/* Take the next cell of an "arguments" continuation out to evaluate it */
+lisp_value* lisp_continuation_next(lisp_continuation* const continuation) {
+    lisp_value** cell = &continuation->expression->cell[continuation->index];
+    if (continuation->arguments != continuation->expression) {
+        return lisp_value_retain(*cell);
+    }
+    lisp_value* x = *cell;
+    *cell = lisp_value_sexpression();
+    return x;
+}
+
+/* Start an "arguments" continuation on the cells of "expression", which is
+ * taken, and return the first of them */
+lisp_value* lisp_continuation_begin(lisp_continuation* const continuation,
+                                    lisp_value* const expression) {
+    continuation->expression = expression;
+    if (lisp_value_type(expression) == LISP_VALUE_SEXPRESSION &&
+        expression->references == 1 && lisp_heap_is_current(expression)) {
+        continuation->arguments = lisp_value_unshare(expression);
+    } else {
+        continuation->arguments = lisp_value_arguments_new(expression->count);
+    }
+    return lisp_continuation_next(continuation);
+}
+
+/* Hand the value of the cell taken last to an "arguments" continuation */
+void lisp_continuation_store(lisp_continuation* const continuation,
+                             lisp_value* const x) {
+    continuation->arguments->cell[continuation->index] = x;
+    continuation->index += 1;
+    if (continuation->arguments != continuation->expression) {
+        continuation->arguments->count = continuation->index;
+    }
+}
+
+/* Drop an "arguments" continuation's expression, if its values went
+ * elsewhere, and return the arguments */
+lisp_value* lisp_continuation_end(lisp_continuation* const continuation) {
+    if (continuation->arguments != continuation->expression) {
+        lisp_value_delete(continuation->expression);
+    }
+    return continuation->arguments;
+}
+
+/* Apply the head of the evaluated S-Expression "arguments" to the rest.
+ * Returns the result, or NULL if there is an expression left to evaluate,
+ * which is then in "value" and "environment". Continuations at or below
+ * "base" belong to an outer evaluation and are left alone. */
+lisp_value* lisp_evaluation_apply(lisp_environment** const environment,
+                                  lisp_value** const value,
+                                  lisp_value* const arguments,
+                                  const size_t base) {
+    if (arguments->count == 1) {
+        return lisp_value_take(arguments, 0);
+    }
+
+    lisp_value* function = lisp_value_pop(arguments, 0);
+    if (lisp_value_type(function) != LISP_VALUE_FUNCTION) {
+        lisp_value_delete(arguments);
+        lisp_value* error = lisp_value_error(
+            "S-expression must start with a function. Got '%s'",
+            lisp_type_name(lisp_value_type(function)));
+        lisp_value_delete(function);
+        return error;
+    }
+
+    if (lisp_value_is_builtin(function)) {
+        lisp_builtin builtin = function->builtin;
+        lisp_value_delete(function);
+        /* 'if' and 'eval' hand their expression back to be evaluated here,
+         * in place of the call */
+        lisp_value* x = NULL;
+        if (builtin == builtin_if) {
+            x = lisp_value_if_branch(arguments);
+        } else if (builtin == builtin_eval) {
+            x = lisp_value_eval_expression(arguments);
+        } else {
+            return builtin(*environment, arguments);
+        }
+        if (lisp_value_type(x) == LISP_VALUE_ERROR) {
+            return x;
+        }
+        *value = x;
+        return NULL;
+    }
+
+    /* A call in tail position, the last one of a body or of an 'if' branch,
+     * does not nest: it binds its arguments in the caller's frame and its
+     * body takes over the caller's continuation, so that a loop written as
+     * recursion runs in constant space. Scope is dynamic, so the callee
+     * would have found the caller's bindings behind its own anyway. */
+    lisp_continuation* top = NULL;
+    if (lisp_continuation_count > base) {
+        top = &lisp_continuations[lisp_continuation_count - 1];
+    }
+    if (top != NULL && top->kind == LISP_CONTINUATION_BODY &&
+        top->environment == *environment) {
+        lisp_value* result = lisp_value_bind(top->environment, function,
+                                             arguments);
+        if (result != NULL) {
+            lisp_value_delete(function);
+            return result;
+        }
+        lisp_value_delete(top->function);
+    } else {
+        lisp_environment* frame = lisp_frame_push(*environment);
+        lisp_value* result = lisp_value_bind(frame, function, arguments);
+        if (result == NULL) {
+            top = lisp_continuation_push(LISP_CONTINUATION_BODY, frame);
+            if (top == NULL) {
+                result = lisp_evaluation_too_deep();
+            }
+        }
+        if (result != NULL) {
+            lisp_frame_pop();
+            lisp_value_delete(function);
+            return result;
+        }
+    }
+    top->function = function;
+    *environment = top->environment;
+    if (lisp_value_count(function->body) == 0) {
+        return lisp_value_sexpression();
+    }
+    /* The body is a Q-Expression evaluated as an S-Expression, where it is */
+    lisp_continuation* body =
+        lisp_continuation_push(LISP_CONTINUATION_ARGUMENTS, *environment);
+    if (body == NULL) {
+        return lisp_evaluation_too_deep();
+    }
+    *value = lisp_continuation_begin(body, lisp_value_retain(function->body));
+    return NULL;
+}
+
+lisp_value* lisp_value_evaluate_tree(lisp_environment* environment,
+                                     lisp_value* value) {
+    size_t base = lisp_continuation_count;
+    /* NULL while "value" still has to be evaluated */
+    lisp_value* result = NULL;
+    for (;;) {
+        if (result == NULL) {
+            int type = lisp_value_type(value);
+            if (type == LISP_VALUE_SYMBOL) {
+                result = lisp_environment_get(environment, value);
+                lisp_value_delete(value);
+            } else if (type == LISP_VALUE_SEXPRESSION &&
+                       lisp_value_count(value) > 0) {
+                lisp_continuation* continuation = lisp_continuation_push(
+                    LISP_CONTINUATION_ARGUMENTS, environment);
+                if (continuation == NULL) {
+                    lisp_value_delete(value);
+                    result = lisp_evaluation_too_deep();
+                } else {
+                    value = lisp_continuation_begin(continuation, value);
+                }
+            } else {
+                result = value;
+            }
+            continue;
+        }
+
+        /* Hand "result" to the innermost continuation */
+        if (lisp_continuation_count == base) {
+            return result;
+        }
+        lisp_continuation* top =
+            &lisp_continuations[lisp_continuation_count - 1];
+        if (top->kind == LISP_CONTINUATION_BODY) {
+            lisp_frame_pop();
+            lisp_value_delete(top->function);
+            lisp_continuation_count -= 1;
+            continue;
+        }
+        if (lisp_value_type(result) == LISP_VALUE_ERROR) {
+            lisp_value_delete(lisp_continuation_end(top));
+            lisp_continuation_count -= 1;
+            continue;
+        }
+        lisp_continuation_store(top, result);
+        environment = top->environment;
+        if (top->index < top->expression->count) {
+            value = lisp_continuation_next(top);
+            result = NULL;
+            continue;
+        }
+        lisp_value* arguments = lisp_continuation_end(top);
+        lisp_continuation_count -= 1;
+        result = lisp_evaluation_apply(&environment, &value, arguments, base);
+    }
+}
+
+/* Code that recurses on the C stack, like the JIT's, gives up rather than
+ * push its frames below this address, or has no floor but its depth limit if
+ * it is 0. It is LISP_STACK_RESERVE bytes above where the stack limit ends,
+ * leaving room for whatever runs after giving up. */
+#ifndef LISP_STACK_RESERVE
+#define LISP_STACK_RESERVE (256 * 1024)
+#endif
+
+uintptr_t lisp_stack_floor = 0;
+
+/* Find the floor from the stack limit and "top", an address in main's frame.
+ * The limit counts from a little above that, where the environment and the
+ * arguments are, which the reserve also has to cover. */
+void lisp_stack_init(const void* const top) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) != 0 ||
+        limit.rlim_cur == RLIM_INFINITY) {
+        return;
+    }
+    uintptr_t room = limit.rlim_cur;
+    lisp_stack_floor = (uintptr_t)top;
+    if (room > LISP_STACK_RESERVE) {
+        lisp_stack_floor -= room - LISP_STACK_RESERVE;
+    }
+}
+
+/* Bytecode. A function body is compiled the first time it runs, and the code
+ * stays on the body until the body is changed or freed. Expressions that are
+ * only evaluated once, like those at the top level or handed to 'eval', get
+ * code that is thrown away afterwards.
+ *
+ * Code refers to the parts of the expression it was compiled from without
+ * holding references to them, which is safe as long as the expression is not
+ * changed, and lisp_value_unshare drops the code before it can be. */
+enum {
+    LISP_OP_CONSTANT,   /* k: push constant k */
+    LISP_OP_FAIL,       /* k: stop with the error in constant k */
+    LISP_OP_LOAD,       /* k: push the value of the symbol in constant k */
+    LISP_OP_CALL,       /* n: apply the function under n - 1 arguments */
+    LISP_OP_TAIL_CALL,  /* n: the same, in place of the body running */
+    LISP_OP_IF_BUILTIN, /* t: jump to t unless 'if' is still builtin_if */
+    LISP_OP_IF_FALSE,   /* e g: jump to e if the condition is 0, or to g if
+                           it is not a Number */
+    LISP_OP_JUMP,       /* t: jump to t */
+    LISP_OP_RETURN
+};
+
+struct lisp_code {
+    lisp_value** constants;
+    unsigned int* instructions;
+    size_t calls;  /* Of the body, counted for the JIT */
+    lisp_jit* jit; /* Once the body has been compiled to native code */
+    lisp_node* node; /* Once the body has been compiled to closures */
+};
+
+typedef struct {
+    unsigned int* instructions;
+    size_t length;
+    size_t capacity;
+    lisp_value** constants;
+    size_t constant_count;
+    size_t constant_capacity;
+} lisp_compiler;
+
+/* Append "word" and return where it went, for jumps to be patched later */
+size_t lisp_compiler_emit(lisp_compiler* const compiler,
+                          const unsigned int word) {
+    if (compiler->length == compiler->capacity) {
+        compiler->capacity = compiler->capacity * 2 + 16;
+        compiler->instructions =
+            realloc(compiler->instructions,
+                    sizeof(unsigned int) * compiler->capacity);
+    }
+    compiler->instructions[compiler->length] = word;
+    compiler->length += 1;
+    return compiler->length - 1;
+}
+
+void lisp_compiler_patch(lisp_compiler* const compiler, const size_t at) {
+    compiler->instructions[at] = compiler->length;
+}
+
+void lisp_compiler_constant(lisp_compiler* const compiler, const int op,
+                            lisp_value* const value) {
+    if (compiler->constant_count == compiler->constant_capacity) {
+        compiler->constant_capacity = compiler->constant_capacity * 2 + 8;
+        compiler->constants =
+            realloc(compiler->constants,
+                    sizeof(lisp_value*) * compiler->constant_capacity);
+    }
+    compiler->constants[compiler->constant_count] = value;
+    compiler->constant_count += 1;
+    lisp_compiler_emit(compiler, op);
+    lisp_compiler_emit(compiler, compiler->constant_count - 1);
+}
+
+void lisp_compile_expression(lisp_compiler* const compiler,
+                             lisp_value* const value, const bool tail);
+
+void lisp_compile_if(lisp_compiler* const compiler,
+                     const lisp_value* const expression, const bool tail);
+
+/* Compile the cells of "expression" as an S-Expression. "tail" is whether
+ * its value is the value of the body being compiled. */
+void lisp_compile_cells(lisp_compiler* const compiler,
+                        const lisp_value* const expression, const bool tail) {
+    size_t count = lisp_value_count(expression);
+    if (count == 0) {
+        lisp_compiler_constant(compiler, LISP_OP_CONSTANT,
+                               lisp_value_sexpression());
+        return;
+    }
+    if (count == 1) {
+        lisp_compile_expression(compiler, expression->cell[0], tail);
+        return;
+    }
+    lisp_value** cell = expression->cell;
+    if (count == 4 && lisp_value_type(cell[0]) == LISP_VALUE_SYMBOL &&
+        cell[0]->symbol == lisp_symbol_if &&
+        lisp_value_type(cell[2]) == LISP_VALUE_QEXPRESSION &&
+        lisp_value_type(cell[3]) == LISP_VALUE_QEXPRESSION) {
+        lisp_compile_if(compiler, expression, tail);
+        return;
+    }
+    for (size_t i = 0; i < count; i += 1) {
+        lisp_compile_expression(compiler, cell[i], false);
+    }
+    lisp_compiler_emit(compiler, tail ? LISP_OP_TAIL_CALL : LISP_OP_CALL);
+    lisp_compiler_emit(compiler, count);
+}
+
+/* An 'if' with both branches written out has them compiled inline, as long
+ * as 'if' is the builtin and the condition a Number when it runs. Otherwise
+ * it is called like any other function. */
+void lisp_compile_if(lisp_compiler* const compiler,
+                     const lisp_value* const expression, const bool tail) {
+    lisp_value** cell = expression->cell;
+    lisp_compile_expression(compiler, cell[0], false);
+    lisp_compiler_emit(compiler, LISP_OP_IF_BUILTIN);
+    size_t call = lisp_compiler_emit(compiler, 0);
+    lisp_compile_expression(compiler, cell[1], false);
+    lisp_compiler_emit(compiler, LISP_OP_IF_FALSE);
+    size_t otherwise = lisp_compiler_emit(compiler, 0);
+    size_t call_evaluated = lisp_compiler_emit(compiler, 0);
+
+    lisp_compile_cells(compiler, cell[2], tail);
+    lisp_compiler_emit(compiler, LISP_OP_JUMP);
+    size_t then_end = lisp_compiler_emit(compiler, 0);
+    lisp_compiler_patch(compiler, otherwise);
+    lisp_compile_cells(compiler, cell[3], tail);
+    lisp_compiler_emit(compiler, LISP_OP_JUMP);
+    size_t otherwise_end = lisp_compiler_emit(compiler, 0);
+
+    lisp_compiler_patch(compiler, call);
+    lisp_compile_expression(compiler, cell[1], false);
+    lisp_compiler_patch(compiler, call_evaluated);
+    lisp_compiler_constant(compiler, LISP_OP_CONSTANT, cell[2]);
+    lisp_compiler_constant(compiler, LISP_OP_CONSTANT, cell[3]);
+    lisp_compiler_emit(compiler, tail ? LISP_OP_TAIL_CALL : LISP_OP_CALL);
+    lisp_compiler_emit(compiler, 4);
+    lisp_compiler_patch(compiler, then_end);
+    lisp_compiler_patch(compiler, otherwise_end);
+}
+
+void lisp_compile_expression(lisp_compiler* const compiler,
+                             lisp_value* const value, const bool tail) {
+    switch (lisp_value_type(value)) {
+        case LISP_VALUE_SYMBOL:
+            lisp_compiler_constant(compiler, LISP_OP_LOAD, value);
+            break;
+        case LISP_VALUE_SEXPRESSION:
+            lisp_compile_cells(compiler, value, tail);
+            break;
+        case LISP_VALUE_ERROR:
+            lisp_compiler_constant(compiler, LISP_OP_FAIL, value);
+            break;
+        default:
+            lisp_compiler_constant(compiler, LISP_OP_CONSTANT, value);
+            break;
+    }
+}
+
+/* Compile "value" as an expression, or if "body" is set, the cells of the
+ * function body "value", into one block allocated from the current heap */
+lisp_code* lisp_code_compile(lisp_value* const value, const bool body) {
+    lisp_compiler compiler = {NULL, 0, 0, NULL, 0, 0};
+    if (body) {
+        lisp_compile_cells(&compiler, value, true);
+    } else {
+        lisp_compile_expression(&compiler, value, false);
+    }
+    lisp_compiler_emit(&compiler, LISP_OP_RETURN);
+
+    size_t constants = sizeof(lisp_value*) * compiler.constant_count;
+    lisp_code* code =
+        lisp_allocate(sizeof(lisp_code) + constants +
+                      sizeof(unsigned int) * compiler.length);
+    code->constants = (lisp_value**)(code + 1);
+    code->instructions = (unsigned int*)((char*)code->constants + constants);
+    memcpy(code->constants, compiler.constants, constants);
+    memcpy(code->instructions, compiler.instructions,
+           sizeof(unsigned int) * compiler.length);
+    code->calls = 0;
+    code->jit = NULL;
+    code->node = NULL;
+    free(compiler.constants);
+    free(compiler.instructions);
+    return code;
+}
+
+/* The code of a function body with cells, compiled into the body's heap */
+lisp_code* lisp_code_of_body(lisp_value* const body) {
+    if (body->code == NULL) {
+        lisp_heap* previous = lisp_heap_enter(lisp_heap_of(body));
+        body->code = lisp_code_compile(body, true);
+        lisp_heap_enter(previous);
+    }
+    return body->code;
+}
+
+/* The virtual machine runs code on a stack of operands, with a frame for each
+ * body or expression running. A frame for a function body holds the function
+ * and pops its environment frame when it returns; one for an expression owns
+ * the expression and its code. Frames and operands at or below the "base" of
+ * an evaluation belong to an outer one, like the one that called 'load'. */
+typedef struct {
+    lisp_code* code;
+    const unsigned int* ip;
+    size_t base;
+    lisp_environment* environment;
+    lisp_value* function;
+    lisp_value* expression;
+} lisp_vm_frame;
+
+lisp_vm_frame* lisp_vm_frames = NULL;
+size_t lisp_vm_frame_count = 0;
+size_t lisp_vm_frame_capacity = 0;
+lisp_value** lisp_vm_stack = NULL;
+size_t lisp_vm_stack_count = 0;
+size_t lisp_vm_stack_capacity = 0;
+
+/* What lisp_value_evaluate runs expressions with: bytecode, unless
+ * --tree-walker or --closures picks another engine */
+enum { LISP_ENGINE_BYTECODE, LISP_ENGINE_TREE, LISP_ENGINE_CLOSURES };
+
+int lisp_evaluation_engine = LISP_ENGINE_BYTECODE;
+
+/* Calls nested on the C stack by the closure engine, which count towards
+ * the same limit as the frames of the virtual machine */
+size_t lisp_closure_depth = 0;
+
+void lisp_vm_push(lisp_value* const value) {
+    if (lisp_vm_stack_count == lisp_vm_stack_capacity) {
+        lisp_vm_stack_capacity = lisp_vm_stack_capacity * 2 + 256;
+        lisp_vm_stack = realloc(lisp_vm_stack,
+                                sizeof(lisp_value*) * lisp_vm_stack_capacity);
+    }
+    lisp_vm_stack[lisp_vm_stack_count] = value;
+    lisp_vm_stack_count += 1;
+}
+
+/* Start running the body of "function", whose arguments are bound in the
+ * environment frame "environment", or else the expression "expression".
+ * Returns false, having let go of both, if evaluation is nested too deep. */
+bool lisp_vm_enter(lisp_environment* const environment,
+                   lisp_value* const function, lisp_value* const expression) {
+    if (lisp_vm_frame_count + lisp_closure_depth >=
+        lisp_evaluation_max_depth) {
+        if (function != NULL) {
+            lisp_frame_pop();
+            lisp_value_delete(function);
+        } else {
+            lisp_value_delete(expression);
+        }
+        return false;
+    }
+    if (lisp_vm_frame_count == lisp_vm_frame_capacity) {
+        lisp_vm_frame_capacity = lisp_vm_frame_capacity * 2 + 64;
+        lisp_vm_frames = realloc(lisp_vm_frames, sizeof(lisp_vm_frame) *
+                                                     lisp_vm_frame_capacity);
+    }
+    lisp_vm_frame* frame = &lisp_vm_frames[lisp_vm_frame_count];
+    lisp_vm_frame_count += 1;
+    frame->code = function != NULL ? lisp_code_of_body(function->body)
+                                   : lisp_code_compile(expression, false);
+    frame->ip = frame->code->instructions;
+    frame->base = lisp_vm_stack_count;
+    frame->environment = environment;
+    frame->function = function;
+    frame->expression = expression;
+    return true;
+}
+
+/* Pop the innermost frame, which must have no operands left */
+void lisp_vm_leave() {
+    lisp_vm_frame* frame = &lisp_vm_frames[lisp_vm_frame_count - 1];
+    if (frame->function != NULL) {
+        lisp_frame_pop();
+        lisp_value_delete(frame->function);
+    } else {
+        lisp_code_free(frame->code);
+        lisp_value_delete(frame->expression);
+    }
+    lisp_vm_frame_count -= 1;
+}
+
+/* Gather the top "count" operands into an S-Expression */
+lisp_value* lisp_vm_pop_arguments(const size_t count) {
+    lisp_value* x = lisp_value_allocate();
+    x->type = LISP_VALUE_SEXPRESSION;
+    x->references = 1;
+    x->count = count;
+    x->cell = lisp_allocate(sizeof(lisp_value*) * count);
+    x->code = NULL;
+    lisp_vm_stack_count -= count;
+    memcpy(x->cell, &lisp_vm_stack[lisp_vm_stack_count],
+           sizeof(lisp_value*) * count);
+    return x;
+}
+
+/* Native code. With --jit, a function that has been called
+ * LISP_JIT_THRESHOLD times is compiled to x86-64 if its body only does
+ * arithmetic and comparisons on its formals and on numbers, branches with
+ * 'if' and calls itself. Such a body has no side effects, so whenever the
+ * native code cannot go on (an overflow, a division by zero, recursion that
+ * gets too deep) it gives up and the call is run again by the interpreter,
+ * which gets the answer, or the error, right.
+ *
+ * The compiler decides what the symbols in a body mean by looking them up
+ * in the caller's environment. Scope is dynamic, so they can mean something
+ * else on another call: each call checks those symbols again before it
+ * enters the native code. The formals of the body are the only other names
+ * it binds, and they cannot be among them.
+ *
+ * Machine code is only freed when the program exits, even if the body it
+ * was compiled from goes away sooner. */
+#ifndef LISP_JIT_THRESHOLD
+#define LISP_JIT_THRESHOLD 100
+#endif
+/* Native recursion runs on the C stack, so it is kept shallower than the
+ * evaluator's own limit, and gives up at lisp_stack_floor */
+#define LISP_JIT_MAX_DEPTH 10000
+/* Native code that keeps giving up, like a recursion that is always too
+ * deep, is not worth trying any more */
+#define LISP_JIT_MAX_BAILOUTS 16
+#define LISP_JIT_MAX_FORMALS 16
+
+/* Returns 0 with the result in "result", or 1 if it gave up */
+typedef int (*lisp_jit_entry)(const long* arguments, long* result,
+                              long depth, uintptr_t stack_floor);
+
+struct lisp_jit {
+    lisp_jit_entry entry; /* NULL if the body could not be compiled */
+    /* The interned names of the formals the body was compiled for, as
+     * lambdas with other formals may share the body */
+    size_t formal_count;
+    char* formals[LISP_JIT_MAX_FORMALS];
+    size_t bailouts;
+    /* The symbols the code depends on, borrowed from the body, and the
+     * builtin each must name, or NULL for the function itself */
+    size_t guard_count;
+    lisp_value** guards;
+    lisp_builtin* builtins;
+    void* memory; /* The pages holding the code */
+    size_t size;
+    lisp_jit* next; /* Every compiled body is on one list */
+};
+
+typedef struct {
+    size_t compiled;
+    size_t rejected;
+    size_t native_calls;
+    size_t bailouts;
+} lisp_jit_statistics;
+
+lisp_jit_statistics lisp_jit_stats;
+bool lisp_jit_enabled = false;
+lisp_jit lisp_jit_rejected = {NULL, 0, {NULL}, 0, 0, NULL, NULL, NULL, 0, NULL};
+lisp_jit* lisp_jit_all = NULL;
+
+#ifdef LISP_JIT_NATIVE
+
+typedef struct {
+    unsigned char* bytes;
+    size_t length;
+    size_t capacity;
+    lisp_environment* environment; /* Where symbols are looked up */
+    const lisp_value* function;
+    lisp_jit* jit;
+    size_t bailout; /* Where the code to give up starts */
+    size_t body;
+    size_t start; /* Of the body, past its prologue */
+} lisp_jit_compiler;
+
+void lisp_jit_emit(lisp_jit_compiler* const compiler,
+                   const char* const bytes, const size_t length) {
+    if (compiler->length + length > compiler->capacity) {
+        compiler->capacity = (compiler->length + length) * 2;
+        compiler->bytes = realloc(compiler->bytes, compiler->capacity);
+    }
+    memcpy(compiler->bytes + compiler->length, bytes, length);
+    compiler->length += length;
+}
+
+void lisp_jit_emit32(lisp_jit_compiler* const compiler, const int32_t word) {
+    lisp_jit_emit(compiler, (const char*)&word, 4);
+}
+
+void lisp_jit_emit64(lisp_jit_compiler* const compiler, const int64_t word) {
+    lisp_jit_emit(compiler, (const char*)&word, 8);
+}
+
+/* Emit the jump or call "op" to "target", or to a placeholder to patch
+ * later if "target" is not known yet. Returns where the offset is. */
+size_t lisp_jit_jump(lisp_jit_compiler* const compiler, const char* const op,
+                     const size_t length, const size_t target) {
+    lisp_jit_emit(compiler, op, length);
+    size_t at = compiler->length;
+    lisp_jit_emit32(compiler, (int32_t)(target - (at + 4)));
+    return at;
+}
+
+void lisp_jit_patch(lisp_jit_compiler* const compiler, const size_t at) {
+    int32_t offset = (int32_t)(compiler->length - (at + 4));
+    memcpy(compiler->bytes + at, &offset, 4);
+}
+
+/* Where formal "i" is relative to rbp. The caller pushes them in order
+ * before the return address. */
+int32_t lisp_jit_formal(const lisp_jit_compiler* const compiler,
+                        const size_t i) {
+    return 16 + 8 * (int32_t)(compiler->jit->formal_count - 1 - i);
+}
+
+/* The formal "symbol" names, or the formal count if none. A name given
+ * twice is bound to the later argument. */
+size_t lisp_jit_formal_index(const lisp_jit_compiler* const compiler,
+                             const lisp_value* const symbol) {
+    const lisp_value* formals = compiler->function->formals;
+    for (size_t i = compiler->jit->formal_count; i > 0; i -= 1) {
+        if (formals->cell[i - 1]->symbol == symbol->symbol) {
+            return i - 1;
+        }
+    }
+    return compiler->jit->formal_count;
+}
+
+void lisp_jit_guard(lisp_jit_compiler* const compiler,
+                    lisp_value* const symbol, const lisp_builtin builtin) {
+    lisp_jit* jit = compiler->jit;
+    for (size_t i = 0; i < jit->guard_count; i += 1) {
+        if (jit->guards[i]->symbol == symbol->symbol) {
+            return;
+        }
+    }
+    jit->guard_count += 1;
+    jit->guards =
+        realloc(jit->guards, sizeof(lisp_value*) * jit->guard_count);
+    jit->builtins =
+        realloc(jit->builtins, sizeof(lisp_builtin) * jit->guard_count);
+    jit->guards[jit->guard_count - 1] = symbol;
+    jit->builtins[jit->guard_count - 1] = builtin;
+}
+
+bool lisp_jit_cells(lisp_jit_compiler* const compiler,
+                    const lisp_value* const expression, const bool tail);
+
+/* Compile code that leaves the value of "value" in rax */
+bool lisp_jit_value(lisp_jit_compiler* const compiler,
+                    const lisp_value* const value, const bool tail) {
+    switch (lisp_value_type(value)) {
+        case LISP_VALUE_NUMBER:
+            lisp_jit_emit(compiler, "\x48\xb8", 2); /* mov rax, imm64 */
+            lisp_jit_emit64(compiler, lisp_value_get_number(value));
+            return true;
+        case LISP_VALUE_SYMBOL: {
+            size_t i = lisp_jit_formal_index(compiler, value);
+            if (i == compiler->jit->formal_count) {
+                return false;
+            }
+            lisp_jit_emit(compiler, "\x48\x8b\x85", 3); /* mov rax, [rbp+] */
+            lisp_jit_emit32(compiler, lisp_jit_formal(compiler, i));
+            return true;
+        }
+        case LISP_VALUE_SEXPRESSION:
+            return lisp_jit_cells(compiler, value, tail);
+        default:
+            return false;
+    }
+}
+
+/* Compile the operands of "expression" in turn, with the running value in
+ * rax and the next operand in rcx, applying "builtin" to each pair */
+bool lisp_jit_fold(lisp_jit_compiler* const compiler,
+                   const lisp_value* const expression,
+                   const lisp_builtin builtin) {
+    if (!lisp_jit_value(compiler, expression->cell[1], false)) {
+        return false;
+    }
+    for (size_t i = 2; i < expression->count; i += 1) {
+        lisp_jit_emit(compiler, "\x50", 1); /* push rax */
+        if (!lisp_jit_value(compiler, expression->cell[i], false)) {
+            return false;
+        }
+        lisp_jit_emit(compiler, "\x48\x89\xc1\x58", 4); /* mov rcx, rax; pop */
+        if (builtin == builtin_div || builtin == builtin_mod) {
+            /* Give up on a zero divisor, and on -1 as LONG_MIN / -1 traps */
+            lisp_jit_emit(compiler, "\x48\x85\xc9", 3); /* test rcx, rcx */
+            lisp_jit_jump(compiler, "\x0f\x84", 2, compiler->bailout);
+            lisp_jit_emit(compiler, "\x48\x83\xf9\xff", 4); /* cmp rcx, -1 */
+            lisp_jit_jump(compiler, "\x0f\x84", 2, compiler->bailout);
+            lisp_jit_emit(compiler, "\x48\x99\x48\xf7\xf9", 5); /* idiv */
+            if (builtin == builtin_mod) {
+                lisp_jit_emit(compiler, "\x48\x89\xd0", 3); /* mov rax, rdx */
+            }
+            continue;
+        }
+        if (builtin == builtin_add) {
+            lisp_jit_emit(compiler, "\x48\x01\xc8", 3); /* add rax, rcx */
+        } else if (builtin == builtin_sub) {
+            lisp_jit_emit(compiler, "\x48\x29\xc8", 3); /* sub rax, rcx */
+        } else {
+            lisp_jit_emit(compiler, "\x48\x0f\xaf\xc1", 4); /* imul */
+        }
+        lisp_jit_jump(compiler, "\x0f\x80", 2, compiler->bailout); /* jo */
+    }
+    return true;
+}
+
+bool lisp_jit_builtin(lisp_jit_compiler* const compiler,
+                      const lisp_value* const expression,
+                      const lisp_builtin builtin, const bool tail) {
+    lisp_value** cell = expression->cell;
+    if (builtin == builtin_if) {
+        if (expression->count != 4 ||
+            lisp_value_type(cell[2]) != LISP_VALUE_QEXPRESSION ||
+            lisp_value_type(cell[3]) != LISP_VALUE_QEXPRESSION ||
+            !lisp_jit_value(compiler, cell[1], false)) {
+            return false;
+        }
+        lisp_jit_emit(compiler, "\x48\x85\xc0", 3); /* test rax, rax */
+        size_t otherwise = lisp_jit_jump(compiler, "\x0f\x84", 2, 0);
+        if (!lisp_jit_cells(compiler, cell[2], tail)) {
+            return false;
+        }
+        size_t end = lisp_jit_jump(compiler, "\xe9", 1, 0);
+        lisp_jit_patch(compiler, otherwise);
+        if (!lisp_jit_cells(compiler, cell[3], tail)) {
+            return false;
+        }
+        lisp_jit_patch(compiler, end);
+        return true;
+    }
+
+    if (builtin == builtin_add || builtin == builtin_sub ||
+        builtin == builtin_mul || builtin == builtin_div ||
+        builtin == builtin_mod) {
+        if (expression->count == 2 && builtin == builtin_sub) {
+            if (!lisp_jit_value(compiler, cell[1], false)) {
+                return false;
+            }
+            lisp_jit_emit(compiler, "\x48\xf7\xd8", 3); /* neg rax */
+            lisp_jit_jump(compiler, "\x0f\x80", 2, compiler->bailout);
+            return true;
+        }
+        return lisp_jit_fold(compiler, expression, builtin);
+    }
+
+    /* The second byte of setcc for each comparison */
+    char condition;
+    if (builtin == builtin_equal) {
+        condition = '\x94';
+    } else if (builtin == builtin_not_equal) {
+        condition = '\x95';
+    } else if (builtin == builtin_lesser_than) {
+        condition = '\x9c';
+    } else if (builtin == builtin_greater_than) {
+        condition = '\x9f';
+    } else if (builtin == builtin_lesser_than_or_equal_to) {
+        condition = '\x9e';
+    } else if (builtin == builtin_greater_than_or_equal_to) {
+        condition = '\x9d';
+    } else {
+        return false;
+    }
+    if (expression->count != 3 || !lisp_jit_value(compiler, cell[1], false)) {
+        return false;
+    }
+    lisp_jit_emit(compiler, "\x50", 1); /* push rax */
+    if (!lisp_jit_value(compiler, cell[2], false)) {
+        return false;
+    }
+    /* mov rcx, rax; pop rax; cmp rax, rcx; setcc al; movzx eax, al */
+    lisp_jit_emit(compiler, "\x48\x89\xc1\x58\x48\x39\xc8\x0f", 8);
+    lisp_jit_emit(compiler, &condition, 1);
+    lisp_jit_emit(compiler, "\xc0\x0f\xb6\xc0", 4);
+    return true;
+}
+
+/* A call of the function being compiled, which in tail position reuses the
+ * slots of the formals and jumps back to the start */
+bool lisp_jit_recurse(lisp_jit_compiler* const compiler,
+                      const lisp_value* const expression, const bool tail) {
+    size_t count = compiler->jit->formal_count;
+    if (expression->count - 1 != count) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i += 1) {
+        if (!lisp_jit_value(compiler, expression->cell[i + 1], false)) {
+            return false;
+        }
+        lisp_jit_emit(compiler, "\x50", 1); /* push rax */
+    }
+    if (tail) {
+        for (size_t i = count; i > 0; i -= 1) {
+            /* pop rax; mov [rbp+], rax */
+            lisp_jit_emit(compiler, "\x58\x48\x89\x85", 4);
+            lisp_jit_emit32(compiler, lisp_jit_formal(compiler, i - 1));
+        }
+        lisp_jit_jump(compiler, "\xe9", 1, compiler->start);
+        return true;
+    }
+    lisp_jit_jump(compiler, "\xe8", 1, compiler->body);
+    if (count > 0) {
+        lisp_jit_emit(compiler, "\x48\x81\xc4", 3); /* add rsp, imm32 */
+        lisp_jit_emit32(compiler, 8 * (int32_t)count);
+    }
+    return true;
+}
+
+bool lisp_jit_cells(lisp_jit_compiler* const compiler,
+                    const lisp_value* const expression, const bool tail) {
+    size_t count = lisp_value_count(expression);
+    if (count == 0) {
+        return false;
+    }
+    if (count == 1) {
+        return lisp_jit_value(compiler, expression->cell[0], tail);
+    }
+    lisp_value* head = expression->cell[0];
+    if (lisp_value_type(head) != LISP_VALUE_SYMBOL ||
+        lisp_jit_formal_index(compiler, head) < compiler->jit->formal_count) {
+        return false;
+    }
+    lisp_value* callee = lisp_environment_get(compiler->environment, head);
+    bool compiled = false;
+    if (lisp_value_type(callee) != LISP_VALUE_FUNCTION) {
+        compiled = false;
+    } else if (lisp_value_is_builtin(callee)) {
+        lisp_jit_guard(compiler, head, callee->builtin);
+        compiled =
+            lisp_jit_builtin(compiler, expression, callee->builtin, tail);
+    } else if (callee->body == compiler->function->body &&
+               callee->formals == compiler->function->formals &&
+               callee->environment->count == 0) {
+        lisp_jit_guard(compiler, head, NULL);
+        compiled = lisp_jit_recurse(compiler, expression, tail);
+    }
+    lisp_value_delete(callee);
+    return compiled;
+}
+
+/* Compile the body of "function", called from "environment" */
+lisp_jit* lisp_jit_compile(lisp_environment* const environment,
+                           const lisp_value* const function) {
+    size_t count = lisp_value_count(function->formals);
+    if (count > LISP_JIT_MAX_FORMALS) {
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i += 1) {
+        if (function->formals->cell[i]->symbol == lisp_symbol_ampersand) {
+            return NULL;
+        }
+    }
+    lisp_jit* jit = malloc(sizeof(lisp_jit));
+    *jit = (lisp_jit){NULL, count, {NULL}, 0, 0, NULL, NULL, NULL, 0, NULL};
+    for (size_t i = 0; i < count; i += 1) {
+        jit->formals[i] = function->formals->cell[i]->symbol;
+    }
+    lisp_jit_compiler compiler = {NULL, 0, 0, environment, function, jit};
+
+    /* The entry point saves the callee-saved registers it uses, keeps the
+     * stack pointer in r12 for giving up from any depth, the result pointer
+     * in r14, the depth left in r13 and the stack floor in r15, and pushes
+     * the arguments */
+    lisp_jit_emit(&compiler, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10);
+    /* mov r14, rsi; mov r12, rsp; mov r13, rdx; mov r15, rcx */
+    lisp_jit_emit(&compiler, "\x49\x89\xf6\x49\x89\xe4\x49\x89\xd5", 9);
+    lisp_jit_emit(&compiler, "\x49\x89\xcf", 3);
+    for (size_t i = 0; i < count; i += 1) {
+        lisp_jit_emit(&compiler, "\xff\xb7", 2); /* push [rdi+] */
+        lisp_jit_emit32(&compiler, 8 * (int32_t)i);
+    }
+    size_t call = lisp_jit_jump(&compiler, "\xe8", 1, 0);
+    /* mov [r14], rax; xor eax, eax */
+    lisp_jit_emit(&compiler, "\x49\x89\x06\x31\xc0", 5);
+    size_t leave = compiler.length;
+    /* mov rsp, r12, and restore the registers */
+    lisp_jit_emit(&compiler, "\x4c\x89\xe4\x41\x5f\x41\x5e\x41\x5d\x41\x5c",
+                  11);
+    lisp_jit_emit(&compiler, "\x5d\x5b\xc3", 3);
+    compiler.bailout = compiler.length;
+    lisp_jit_emit(&compiler, "\xb8\x01\x00\x00\x00", 5); /* mov eax, 1 */
+    lisp_jit_jump(&compiler, "\xe9", 1, leave);
+
+    /* The body counts down the depth left as it recurses, and gives up when
+     * that runs out or the stack gets down to the floor */
+    lisp_jit_patch(&compiler, call);
+    compiler.body = compiler.length;
+    /* push rbp; mov rbp, rsp; dec r13 */
+    lisp_jit_emit(&compiler, "\x55\x48\x89\xe5\x49\xff\xcd", 7);
+    lisp_jit_jump(&compiler, "\x0f\x84", 2, compiler.bailout);
+    lisp_jit_emit(&compiler, "\x4c\x39\xfc", 3); /* cmp rsp, r15 */
+    lisp_jit_jump(&compiler, "\x0f\x82", 2, compiler.bailout);
+    compiler.start = compiler.length;
+    bool compiled = lisp_jit_cells(&compiler, function->body, true);
+    /* inc r13; pop rbp; ret */
+    lisp_jit_emit(&compiler, "\x49\xff\xc5\x5d\xc3", 5);
+
+    if (compiled) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = (compiler.length + page - 1) / page * page;
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            memcpy(memory, compiler.bytes, compiler.length);
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0) {
+                jit->entry = (lisp_jit_entry)memory;
+                jit->memory = memory;
+                jit->size = size;
+            } else {
+                munmap(memory, size);
+            }
+        }
+    }
+    free(compiler.bytes);
+    if (jit->entry == NULL) {
+        free(jit->guards);
+        free(jit->builtins);
+        free(jit);
+        return NULL;
+    }
+    jit->next = lisp_jit_all;
+    lisp_jit_all = jit;
+    return jit;
+}
+
+void lisp_jit_free_all() {
+    while (lisp_jit_all != NULL) {
+        lisp_jit* jit = lisp_jit_all;
+        lisp_jit_all = jit->next;
+        munmap(jit->memory, jit->size);
+        free(jit->guards);
+        free(jit->builtins);
+        free(jit);
+    }
+}
+
+#else
+
+lisp_jit* lisp_jit_compile(lisp_environment* const environment,
+                           const lisp_value* const function) {
+    return NULL;
+}
+
+void lisp_jit_free_all() {}
+
+#endif
+
+/* Run a call of "function" natively if it is compiled, or has just become
+ * hot enough to be. Returns NULL, leaving "arguments" alone, if the
+ * interpreter has to run it. */
+lisp_value* lisp_jit_call(lisp_environment* const environment,
+                          const lisp_value* const function,
+                          lisp_value* const arguments) {
+    if (lisp_value_count(function->body) == 0 ||
+        function->environment->count > 0) {
+        return NULL;
+    }
+    lisp_code* code = lisp_code_of_body(function->body);
+    if (code->jit == NULL) {
+        code->calls += 1;
+        if (code->calls < LISP_JIT_THRESHOLD) {
+            return NULL;
+        }
+        code->jit = lisp_jit_compile(environment, function);
+        if (code->jit == NULL) {
+            lisp_jit_stats.rejected += 1;
+            code->jit = &lisp_jit_rejected;
+        } else {
+            lisp_jit_stats.compiled += 1;
+        }
+    }
+    lisp_jit* jit = code->jit;
+    if (jit->entry == NULL || arguments->count != jit->formal_count ||
+        lisp_value_count(function->formals) != jit->formal_count) {
+        return NULL;
+    }
+    for (size_t i = 0; i < jit->formal_count; i += 1) {
+        if (function->formals->cell[i]->symbol != jit->formals[i]) {
+            return NULL;
+        }
+    }
+
+    long values[LISP_JIT_MAX_FORMALS];
+    for (size_t i = 0; i < arguments->count; i += 1) {
+        if (lisp_value_type(arguments->cell[i]) != LISP_VALUE_NUMBER) {
+            return NULL;
+        }
+        values[i] = lisp_value_get_number(arguments->cell[i]);
+    }
+    for (size_t i = 0; i < jit->guard_count; i += 1) {
+        lisp_value* x = lisp_environment_get(environment, jit->guards[i]);
+        bool same = false;
+        if (lisp_value_type(x) == LISP_VALUE_FUNCTION) {
+            if (jit->builtins[i] != NULL) {
+                same = lisp_value_is_builtin(x) &&
+                       x->builtin == jit->builtins[i];
+            } else {
+                same = !lisp_value_is_builtin(x) &&
+                       x->body == function->body &&
+                       x->formals == function->formals &&
+                       x->environment->count == 0;
+            }
+        }
+        lisp_value_delete(x);
+        if (!same) {
+            return NULL;
+        }
+    }
+
+    long depth =
+        lisp_evaluation_max_depth - lisp_vm_frame_count - lisp_closure_depth;
+    if (depth > LISP_JIT_MAX_DEPTH) {
+        depth = LISP_JIT_MAX_DEPTH;
+    }
+    long result;
+    if (depth <= 1 ||
+        jit->entry(values, &result, depth, lisp_stack_floor) != 0) {
+        lisp_jit_stats.bailouts += 1;
+        jit->bailouts += 1;
+        if (jit->bailouts == LISP_JIT_MAX_BAILOUTS) {
+            jit->entry = NULL;
+        }
+        return NULL;
+    }
+    lisp_jit_stats.native_calls += 1;
+    lisp_value_delete(arguments);
+    return lisp_value_number(result);
+}
+
+lisp_value* builtin_jit_stats(lisp_environment* const environment,
+                              lisp_value* const arguments) {
+    lisp_value_delete(arguments);
+    lisp_value* x = lisp_value_qexpression();
+    x = lisp_value_add(x, lisp_value_pair("compiled", lisp_jit_stats.compiled));
+    x = lisp_value_add(x, lisp_value_pair("rejected", lisp_jit_stats.rejected));
+    x = lisp_value_add(
+        x, lisp_value_pair("native-calls", lisp_jit_stats.native_calls));
+    x = lisp_value_add(x, lisp_value_pair("bailouts", lisp_jit_stats.bailouts));
+    return x;
+}
+
+/* Dispatch threads through a table of label addresses where the compiler
+ * supports it, and falls back on a switch elsewhere */
+#ifdef __GNUC__
+#define LISP_VM_DISPATCH() goto* labels[*ip++]
+#define LISP_VM_CASE(op) label_##op:
+#else
+#define LISP_VM_DISPATCH() goto dispatch
+#define LISP_VM_CASE(op) case op:
+#endif
+
+/* Run the frames above "base" until they have all returned */
+lisp_value* lisp_vm_run(const size_t base) {
+#ifdef __GNUC__
+    static void* const labels[] = {
+        &&label_LISP_OP_CONSTANT,   &&label_LISP_OP_FAIL,
+        &&label_LISP_OP_LOAD,       &&label_LISP_OP_CALL,
+        &&label_LISP_OP_TAIL_CALL,  &&label_LISP_OP_IF_BUILTIN,
+        &&label_LISP_OP_IF_FALSE,   &&label_LISP_OP_JUMP,
+        &&label_LISP_OP_RETURN};
+#endif
+    lisp_vm_frame* frame = &lisp_vm_frames[lisp_vm_frame_count - 1];
+    const unsigned int* ip = frame->ip;
+    lisp_value* result;
+    lisp_value* function;
+    lisp_value* arguments;
+    bool tail;
+
+#ifdef __GNUC__
+    LISP_VM_DISPATCH();
+#else
+dispatch:
+    switch (*ip++) {
+#endif
+    LISP_VM_CASE(LISP_OP_CONSTANT) {
+        lisp_vm_push(lisp_value_retain(frame->code->constants[*ip]));
+        ip += 1;
+        LISP_VM_DISPATCH();
+    }
+    LISP_VM_CASE(LISP_OP_FAIL) {
+        result = lisp_value_retain(frame->code->constants[*ip]);
+        goto fail;
+    }
+    LISP_VM_CASE(LISP_OP_LOAD) {
+        result = lisp_environment_get(frame->environment,
+                                      frame->code->constants[*ip]);
+        ip += 1;
+        if (lisp_value_type(result) == LISP_VALUE_ERROR) {
+            goto fail;
+        }
+        lisp_vm_push(result);
+        LISP_VM_DISPATCH();
+    }
+    LISP_VM_CASE(LISP_OP_CALL) {
+        tail = false;
+        goto call;
+    }
+    LISP_VM_CASE(LISP_OP_TAIL_CALL) {
+        tail = frame->function != NULL;
+        goto call;
+    }
+    LISP_VM_CASE(LISP_OP_IF_BUILTIN) {
+        function = lisp_vm_stack[lisp_vm_stack_count - 1];
+        if (lisp_value_type(function) == LISP_VALUE_FUNCTION &&
+            lisp_value_is_builtin(function) &&
+            function->builtin == builtin_if) {
+            ip += 1;
+        } else {
+            ip = frame->code->instructions + *ip;
+        }
+        LISP_VM_DISPATCH();
+    }
+    LISP_VM_CASE(LISP_OP_IF_FALSE) {
+        result = lisp_vm_stack[lisp_vm_stack_count - 1];
+        if (lisp_value_type(result) != LISP_VALUE_NUMBER) {
+            ip = frame->code->instructions + ip[1];
+            LISP_VM_DISPATCH();
+        }
+        bool condition = lisp_value_get_number(result) != 0;
+        lisp_value_delete(result);
+        lisp_value_delete(lisp_vm_stack[lisp_vm_stack_count - 2]);
+        lisp_vm_stack_count -= 2;
+        ip = condition ? ip + 2 : frame->code->instructions + ip[0];
+        LISP_VM_DISPATCH();
+    }
+    LISP_VM_CASE(LISP_OP_JUMP) {
+        ip = frame->code->instructions + *ip;
+        LISP_VM_DISPATCH();
+    }
+    LISP_VM_CASE(LISP_OP_RETURN) {
+        result = lisp_vm_stack[lisp_vm_stack_count - 1];
+        lisp_vm_stack_count -= 1;
+        lisp_vm_leave();
+        if (lisp_vm_frame_count == base) {
+            return result;
+        }
+        frame = &lisp_vm_frames[lisp_vm_frame_count - 1];
+        ip = frame->ip;
+        lisp_vm_push(result);
+        LISP_VM_DISPATCH();
+    }
+#ifndef __GNUC__
+    }
+#endif
+
+call:
+    arguments = lisp_vm_pop_arguments(*ip - 1);
+    ip += 1;
+    lisp_vm_stack_count -= 1;
+    function = lisp_vm_stack[lisp_vm_stack_count];
+    if (lisp_value_type(function) != LISP_VALUE_FUNCTION) {
+        lisp_value_delete(arguments);
+        result = lisp_value_error(
+            "S-expression must start with a function. Got '%s'",
+            lisp_type_name(lisp_value_type(function)));
+        lisp_value_delete(function);
+        goto fail;
+    }
+
+    if (lisp_value_is_builtin(function)) {
+        lisp_builtin builtin = function->builtin;
+        lisp_value_delete(function);
+        /* 'if' and 'eval' run their expression in a frame of its own */
+        if (builtin == builtin_if || builtin == builtin_eval) {
+            result = builtin == builtin_if
+                         ? lisp_value_if_branch(arguments)
+                         : lisp_value_eval_expression(arguments);
+            if (lisp_value_type(result) == LISP_VALUE_ERROR) {
+                goto fail;
+            }
+            frame->ip = ip;
+            if (!lisp_vm_enter(frame->environment, NULL, result)) {
+                result = lisp_evaluation_too_deep();
+                goto fail;
+            }
+            goto enter;
+        }
+        result = builtin(frame->environment, arguments);
+        /* The builtin may have evaluated something, and moved the frames */
+        frame = &lisp_vm_frames[lisp_vm_frame_count - 1];
+        if (lisp_value_type(result) == LISP_VALUE_ERROR) {
+            goto fail;
+        }
+        lisp_vm_push(result);
+        LISP_VM_DISPATCH();
+    }
+
+    if (lisp_jit_enabled) {
+        result = lisp_jit_call(frame->environment, function, arguments);
+        if (result != NULL) {
+            lisp_value_delete(function);
+            lisp_vm_push(result);
+            LISP_VM_DISPATCH();
+        }
+    }
+    if (tail) {
+        /* As in the tree walker, a call in tail position binds its arguments
+         * in the frame of the body running and takes over its code */
+        result = lisp_value_bind(frame->environment, function, arguments);
+        if (result == NULL && lisp_value_count(function->body) == 0) {
+            result = lisp_value_sexpression();
+        }
+        if (result != NULL) {
+            lisp_value_delete(function);
+            if (lisp_value_type(result) == LISP_VALUE_ERROR) {
+                goto fail;
+            }
+            lisp_vm_push(result);
+            LISP_VM_DISPATCH();
+        }
+        lisp_value* previous = frame->function;
+        frame->function = function;
+        frame->code = lisp_code_of_body(function->body);
+        lisp_value_delete(previous);
+    } else {
+        lisp_environment* bindings = lisp_frame_push(frame->environment);
+        result = lisp_value_bind(bindings, function, arguments);
+        if (result == NULL && lisp_value_count(function->body) == 0) {
+            result = lisp_value_sexpression();
+        }
+        if (result != NULL) {
+            lisp_frame_pop();
+            lisp_value_delete(function);
+            if (lisp_value_type(result) == LISP_VALUE_ERROR) {
+                goto fail;
+            }
+            lisp_vm_push(result);
+            LISP_VM_DISPATCH();
+        }
+        frame->ip = ip;
+        if (!lisp_vm_enter(bindings, function, NULL)) {
+            result = lisp_evaluation_too_deep();
+            goto fail;
+        }
+    }
+enter:
+    frame = &lisp_vm_frames[lisp_vm_frame_count - 1];
+    ip = frame->code->instructions;
+    LISP_VM_DISPATCH();
+
+fail:
+    /* An error ends the whole evaluation */
+    while (lisp_vm_frame_count > base) {
+        frame = &lisp_vm_frames[lisp_vm_frame_count - 1];
+        while (lisp_vm_stack_count > frame->base) {
+            lisp_vm_stack_count -= 1;
+            lisp_value_delete(lisp_vm_stack[lisp_vm_stack_count]);
+        }
+        lisp_vm_leave();
+    }
+    return result;
+}
+
+lisp_value* lisp_vm_evaluate(lisp_environment* const environment,
+                             lisp_value* const value) {
+    size_t base = lisp_vm_frame_count;
+    if (!lisp_vm_enter(environment, NULL, value)) {
+        return lisp_evaluation_too_deep();
+    }
+    return lisp_vm_run(base);
+}
+
+/* Call the lambda "function" with "arguments" on the virtual machine */
+lisp_value* lisp_vm_apply(lisp_environment* const environment,
+                          lisp_value* const function,
+                          lisp_value* const arguments) {
+    size_t base = lisp_vm_frame_count;
+    lisp_environment* bindings = lisp_frame_push(environment);
+    lisp_value* result = lisp_value_bind(bindings, function, arguments);
+    if (result == NULL && lisp_value_count(function->body) == 0) {
+        result = lisp_value_sexpression();
+    }
+    if (result != NULL) {
+        lisp_frame_pop();
+        lisp_value_delete(function);
+        return result;
+    }
+    if (!lisp_vm_enter(bindings, function, NULL)) {
+        return lisp_evaluation_too_deep();
+    }
+    return lisp_vm_run(base);
 }
 
-lisp_value* builtin_greater_than(lisp_environment* const environment,
-                                 lisp_value* const arguments) {
-    return builtin_order(environment, arguments, ">");
-}
+/* Closure compilation. With --closures, a function body is translated the
+ * first time it runs into a tree of nodes, each holding the C function that
+ * evaluates it and the nodes of its parts, and from then on it is evaluated
+ * by calling through the tree: what each part is was decided once, when it
+ * was compiled. The tree is kept on the body's code next to its bytecode and
+ * goes with it, and like the bytecode it borrows the parts of the body.
+ *
+ * Calls nest on the C stack, so those deeper than LISP_CLOSURE_MAX_DEPTH are
+ * handed to the virtual machine, which keeps its frames on the heap. */
+#define LISP_CLOSURE_MAX_DEPTH 2000
 
-lisp_value* builtin_lesser_than(lisp_environment* const environment,
-                                lisp_value* const arguments) {
-    return builtin_order(environment, arguments, "<");
-}
+typedef lisp_value* (*lisp_node_function)(const lisp_node*,
+                                          lisp_environment*);
 
-lisp_value* builtin_greater_than_or_equal_to(
-    lisp_environment* const environment, lisp_value* const arguments) {
-    return builtin_order(environment, arguments, ">=");
-}
+struct lisp_node {
+    lisp_node_function run;
+    lisp_value* value; /* The constant, symbol or 'if' expression */
+    bool tail;         /* Whether its value is the value of the body */
+    size_t count;
+    lisp_node** children;
+};
+
+/* A call in tail position returns this, leaving the function and arguments
+ * for the body running to call in its own place */
+lisp_value lisp_closure_tail_call;
+lisp_value* lisp_closure_function = NULL;
+lisp_value* lisp_closure_arguments = NULL;
 
-lisp_value* builtin_lesser_than_or_equal_to(lisp_environment* const environment,
-                                            lisp_value* const arguments) {
-    return builtin_order(environment, arguments, "<=");
+lisp_node* lisp_node_new(const lisp_node_function run, lisp_value* const value,
+                         const size_t count, const bool tail) {
+    lisp_node* node =
+        lisp_allocate(sizeof(lisp_node) + sizeof(lisp_node*) * count);
+    node->run = run;
+    node->value = value;
+    node->tail = tail;
+    node->count = count;
+    node->children = (lisp_node**)(node + 1);
+    return node;
 }
 
-int lisp_value_equal(lisp_value* x, lisp_value* y) {
-    if (x->type != y->type) {
-        return 0;
+void lisp_node_free(lisp_node* const node) {
+    if (node == NULL) {
+        return;
     }
+    for (size_t i = 0; i < node->count; i += 1) {
+        lisp_node_free(node->children[i]);
+    }
+    lisp_free(node);
+}
 
-    switch (x->type) {
-        case LISP_VALUE_NUMBER:
-            return x->number == y->number;
-        case LISP_VALUE_STRING:
-            return strcmp(x->string, y->string) == 0;
-        case LISP_VALUE_ERROR:
-            return strcmp(x->error, y->error) == 0;
-        case LISP_VALUE_SYMBOL:
-            return strcmp(x->symbol, y->symbol) == 0;
-        case LISP_VALUE_FUNCTION:
-            if (x->builtin || y->builtin) {
-                return x->builtin == y->builtin;
-            } else {
-                return lisp_value_equal(x->formals, y->formals) &&
-                       lisp_value_equal(x->body, y->body);
-            }
-        case LISP_VALUE_SEXPRESSION:
-        case LISP_VALUE_QEXPRESSION:
-            if (x->count != y->count) {
-                return 0;
-            }
-            for (size_t i = 0; i < x->count; i += 1) {
-                if (!lisp_value_equal(x->cell[i], y->cell[i])) {
-                    return 0;
-                }
-            }
-            return 1;
+void lisp_code_free(lisp_code* const code) {
+    if (code == NULL) {
+        return;
     }
-    return 0;
+    lisp_node_free(code->node);
+    lisp_free(code);
 }
 
-lisp_value* builtin_compare(lisp_environment* const environment,
-                            lisp_value* const arguments, const char* const op) {
-    if (arguments->count != 2) {
-        lisp_value* error =
-            lisp_value_error("Function '%s' expects 2 arguments. Got %li.", op,
-                             arguments->count);
+lisp_value* lisp_closure_call(lisp_environment* const environment,
+                              lisp_value* function,
+                              lisp_value* const arguments);
+
+lisp_value* lisp_closure_evaluate(lisp_environment* const environment,
+                                  lisp_value* const value);
+
+/* Apply "function" to "arguments", taking both */
+lisp_value* lisp_closure_apply(lisp_environment* const environment,
+                               lisp_value* const function,
+                               lisp_value* const arguments, const bool tail) {
+    if (lisp_value_type(function) != LISP_VALUE_FUNCTION) {
         lisp_value_delete(arguments);
+        lisp_value* error = lisp_value_error(
+            "S-expression must start with a function. Got '%s'",
+            lisp_type_name(lisp_value_type(function)));
+        lisp_value_delete(function);
         return error;
     }
-    int r;
-    if (strcmp(op, "==") == 0) {
-        r = lisp_value_equal(arguments->cell[0], arguments->cell[1]);
-    } else if (strcmp(op, "!=") == 0) {
-        r = !lisp_value_equal(arguments->cell[0], arguments->cell[1]);
-    } else {
-        lisp_value_delete(arguments);
-        return lisp_value_error("Function '%s' not found.");
+
+    if (lisp_value_is_builtin(function)) {
+        lisp_builtin builtin = function->builtin;
+        lisp_value_delete(function);
+        if (builtin == builtin_if || builtin == builtin_eval) {
+            lisp_value* x = builtin == builtin_if
+                                ? lisp_value_if_branch(arguments)
+                                : lisp_value_eval_expression(arguments);
+            if (lisp_value_type(x) == LISP_VALUE_ERROR) {
+                return x;
+            }
+            return lisp_closure_evaluate(environment, x);
+        }
+        return builtin(environment, arguments);
     }
-    lisp_value_delete(arguments);
-    return lisp_value_number(r);
+
+    if (lisp_jit_enabled) {
+        lisp_value* result = lisp_jit_call(environment, function, arguments);
+        if (result != NULL) {
+            lisp_value_delete(function);
+            return result;
+        }
+    }
+    if (tail) {
+        lisp_closure_function = function;
+        lisp_closure_arguments = arguments;
+        return &lisp_closure_tail_call;
+    }
+    return lisp_closure_call(environment, function, arguments);
 }
 
-lisp_value* builtin_equal(lisp_environment* const environment,
-                          lisp_value* const arguments) {
-    return builtin_compare(environment, arguments, "==");
+lisp_value* lisp_node_constant(const lisp_node* const node,
+                               lisp_environment* const environment) {
+    return lisp_value_retain(node->value);
 }
 
-lisp_value* builtin_not_equal(lisp_environment* const environment,
-                              lisp_value* const arguments) {
-    return builtin_compare(environment, arguments, "!=");
+lisp_value* lisp_node_load(const lisp_node* const node,
+                           lisp_environment* const environment) {
+    return lisp_environment_get(environment, node->value);
 }
 
-lisp_value* builtin_if(lisp_environment* const environment,
-                       lisp_value* const arguments) {
-    if (arguments->count != 3) {
-        lisp_value* error = lisp_value_error(
-            "Function 'if' expects 3 arguments. Got %li.", arguments->count);
-        lisp_value_delete(arguments);
-        return error;
+lisp_value* lisp_node_call(const lisp_node* const node,
+                           lisp_environment* const environment) {
+    const lisp_node* head = node->children[0];
+    lisp_value* function = head->run(head, environment);
+    if (lisp_value_type(function) == LISP_VALUE_ERROR) {
+        return function;
     }
-    if (arguments->cell[0]->type != LISP_VALUE_NUMBER) {
-        lisp_value* error = lisp_value_error(
-            "Function 'if' expects a Number for its first argument. Got '%s'.",
-            lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
+    lisp_value* arguments = lisp_value_arguments_new(node->count - 1);
+    for (size_t i = 1; i < node->count; i += 1) {
+        const lisp_node* child = node->children[i];
+        lisp_value* x = child->run(child, environment);
+        if (lisp_value_type(x) == LISP_VALUE_ERROR) {
+            lisp_value_delete(arguments);
+            lisp_value_delete(function);
+            return x;
+        }
+        arguments->cell[arguments->count] = x;
+        arguments->count += 1;
     }
-    if (arguments->cell[1]->type != LISP_VALUE_QEXPRESSION) {
-        lisp_value* error = lisp_value_error(
-            "Function 'if' expects a Q-Expression for its second argument. Got "
-            "'%s'.",
-            lisp_type_name(arguments->cell[1]->type));
-        lisp_value_delete(arguments);
-        return error;
+    return lisp_closure_apply(environment, function, arguments, node->tail);
+}
+
+/* An 'if' with both branches written out, whose children are the head, the
+ * condition and the two branches. As long as the head is still builtin_if
+ * and the condition a Number, the branch taken runs in place; otherwise it
+ * is called like any other function. */
+lisp_value* lisp_node_if(const lisp_node* const node,
+                         lisp_environment* const environment) {
+    const lisp_node* head = node->children[0];
+    lisp_value* function = head->run(head, environment);
+    if (lisp_value_type(function) == LISP_VALUE_ERROR) {
+        return function;
     }
-    if (arguments->cell[2]->type != LISP_VALUE_QEXPRESSION) {
-        lisp_value* error = lisp_value_error(
-            "Function 'if' expects a Q-Expression for its third argument. Got "
-            "'%s'.",
-            lisp_type_name(arguments->cell[2]->type));
-        lisp_value_delete(arguments);
-        return error;
+    const lisp_node* test = node->children[1];
+    lisp_value* condition = test->run(test, environment);
+    if (lisp_value_type(condition) == LISP_VALUE_ERROR) {
+        lisp_value_delete(function);
+        return condition;
     }
-
-    lisp_value* x;
-    if (arguments->cell[0]->number) {
-        arguments->cell[1]->type = LISP_VALUE_SEXPRESSION;
-        x = lisp_value_evaluate(environment, lisp_value_pop(arguments, 1));
-    } else {
-        arguments->cell[2]->type = LISP_VALUE_SEXPRESSION;
-        x = lisp_value_evaluate(environment, lisp_value_pop(arguments, 2));
+    if (lisp_value_type(function) == LISP_VALUE_FUNCTION &&
+        lisp_value_is_builtin(function) && function->builtin == builtin_if &&
+        lisp_value_type(condition) == LISP_VALUE_NUMBER) {
+        const lisp_node* branch =
+            node->children[lisp_value_get_number(condition) != 0 ? 2 : 3];
+        lisp_value_delete(function);
+        lisp_value_delete(condition);
+        return branch->run(branch, environment);
     }
-    lisp_value_delete(arguments);
-    return x;
+    lisp_value* arguments = lisp_value_arguments_new(3);
+    arguments->cell[0] = condition;
+    arguments->cell[1] = lisp_value_retain(node->value->cell[2]);
+    arguments->cell[2] = lisp_value_retain(node->value->cell[3]);
+    arguments->count = 3;
+    return lisp_closure_apply(environment, function, arguments, node->tail);
 }
 
-lisp_value* builtin_load(lisp_environment* const environment,
-                         lisp_value* const arguments) {
-    if (arguments->count != 1) {
-        lisp_value* error = lisp_value_error(
-            "Function 'load' expects 1 argument. Got %li.", arguments->count);
-        lisp_value_delete(arguments);
-        return error;
+lisp_node* lisp_node_compile(lisp_value* const value, const bool tail);
+
+/* Compile the cells of "expression" as an S-Expression, like
+ * lisp_compile_cells */
+lisp_node* lisp_node_compile_cells(lisp_value* const expression,
+                                   const bool tail) {
+    size_t count = lisp_value_count(expression);
+    if (count == 0) {
+        return lisp_node_new(lisp_node_constant, lisp_value_sexpression(), 0,
+                             tail);
     }
-    if (arguments->cell[0]->type != LISP_VALUE_STRING) {
-        lisp_value* error = lisp_value_error(
-            "Function 'load' expects a String for its first argument. Got "
-            "'%s'.",
-            lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
+    if (count == 1) {
+        return lisp_node_compile(expression->cell[0], tail);
     }
-    mpc_result_t result;
-    if (mpc_parse_contents(arguments->cell[0]->string, Lispy, &result)) {
-        lisp_value* expression = lisp_value_read(result.output);
-        mpc_ast_delete(result.output);
-
-        while (expression->count > 0) {
-            lisp_value* x =
-                lisp_value_evaluate(environment, lisp_value_pop(expression, 0));
-            lisp_value_println(x);
-            if (x->type == LISP_VALUE_ERROR) {
-                lisp_value_println(x);
-            }
-            lisp_value_delete(x);
-        }
-
-        lisp_value_delete(expression);
-        lisp_value_delete(arguments);
-
-        return lisp_value_sexpression();
-    } else {
-        char* error_message = mpc_err_string(result.error);
-        mpc_err_delete(result.error);
-        lisp_value* error =
-            lisp_value_error("Could not load library %s", error_message);
-        free(error_message);
-        lisp_value_delete(arguments);
-        return error;
+    lisp_value** cell = expression->cell;
+    if (count == 4 && lisp_value_type(cell[0]) == LISP_VALUE_SYMBOL &&
+        cell[0]->symbol == lisp_symbol_if &&
+        lisp_value_type(cell[2]) == LISP_VALUE_QEXPRESSION &&
+        lisp_value_type(cell[3]) == LISP_VALUE_QEXPRESSION) {
+        lisp_node* node = lisp_node_new(lisp_node_if, expression, 4, tail);
+        node->children[0] = lisp_node_compile(cell[0], false);
+        node->children[1] = lisp_node_compile(cell[1], false);
+        node->children[2] = lisp_node_compile_cells(cell[2], tail);
+        node->children[3] = lisp_node_compile_cells(cell[3], tail);
+        return node;
+    }
+    lisp_node* node = lisp_node_new(lisp_node_call, NULL, count, tail);
+    for (size_t i = 0; i < count; i += 1) {
+        node->children[i] = lisp_node_compile(cell[i], false);
     }
+    return node;
 }
 
-lisp_value* builtin_print(lisp_environment* const environment,
-                          lisp_value* const arguments) {
-    bool first = true;
-    for (size_t i = 0; i < arguments->count; i += 1) {
-        if (first) {
-            first = false;
-        } else {
-            putchar(' ');
-        }
-        lisp_value_print(arguments->cell[i]);
+lisp_node* lisp_node_compile(lisp_value* const value, const bool tail) {
+    switch (lisp_value_type(value)) {
+        case LISP_VALUE_SYMBOL:
+            return lisp_node_new(lisp_node_load, value, 0, tail);
+        case LISP_VALUE_SEXPRESSION:
+            return lisp_node_compile_cells(value, tail);
+        default:
+            /* An error is a constant too, and stops whatever evaluates it */
+            return lisp_node_new(lisp_node_constant, value, 0, tail);
     }
-    putchar('\n');
-    lisp_value_delete(arguments);
-    return lisp_value_sexpression();
 }
 
-lisp_value* builtin_error(lisp_environment* const environment,
-                          lisp_value* const arguments) {
-    if (arguments->count != 1) {
-        lisp_value* error = lisp_value_error(
-            "Function 'error' expects 1 argument. Got %li.", arguments->count);
-        lisp_value_delete(arguments);
-        return error;
-    }
-    if (arguments->cell[0]->type != LISP_VALUE_STRING) {
-        lisp_value* error = lisp_value_error(
-            "Function 'error' expects a String for its first argument. Got "
-            "'%s'.",
-            lisp_type_name(arguments->cell[0]->type));
-        lisp_value_delete(arguments);
-        return error;
+/* The tree of a function body with cells, compiled into the body's heap */
+lisp_node* lisp_node_of_body(lisp_value* const body) {
+    lisp_code* code = lisp_code_of_body(body);
+    if (code->node == NULL) {
+        lisp_heap* previous = lisp_heap_enter(lisp_heap_of(body));
+        code->node = lisp_node_compile_cells(body, true);
+        lisp_heap_enter(previous);
     }
-    lisp_value* error = lisp_value_error(arguments->cell[0]->string);
-    lisp_value_delete(arguments);
-    return error;
+    return code->node;
 }
 
-lisp_value* lisp_value_call(lisp_environment* const environment,
-                            lisp_value* const function,
-                            lisp_value* const arguments) {
-    if (function->builtin != NULL) {
-        return function->builtin(environment, arguments);
+/* Call the lambda "function" with "arguments", taking both. A call in tail
+ * position in the body binds its arguments in the same frame and runs its
+ * body in place of this one. */
+lisp_value* lisp_closure_call(lisp_environment* const environment,
+                              lisp_value* function,
+                              lisp_value* const arguments) {
+    if (lisp_closure_depth + lisp_vm_frame_count >=
+        lisp_evaluation_max_depth) {
+        lisp_value_delete(arguments);
+        lisp_value_delete(function);
+        return lisp_evaluation_too_deep();
     }
-    size_t given = arguments->count;
-    size_t total = function->formals->count;
-    while (arguments->count > 0) {
-        if (function->formals->count == 0) {
-            lisp_value* error = lisp_value_error(
-                "Function passed too many arguments. Expected %li. Got %li.",
-                total, given);
-            lisp_value_delete(arguments);
-            return error;
+    if (lisp_closure_depth >= LISP_CLOSURE_MAX_DEPTH) {
+        return lisp_vm_apply(environment, function, arguments);
+    }
+    lisp_environment* frame = lisp_frame_push(environment);
+    lisp_value* result = lisp_value_bind(frame, function, arguments);
+    lisp_closure_depth += 1;
+    while (result == NULL) {
+        if (lisp_value_count(function->body) == 0) {
+            result = lisp_value_sexpression();
+            break;
         }
-        lisp_value* symbol = lisp_value_pop(function->formals, 0);
-
-        /* Special case to deal with '&' */
-        if (strcmp(symbol->symbol, "&") == 0) {
-            if (function->formals->count != 1) {
-                lisp_value_delete(arguments);
-                return lisp_value_error(
-                    "Function format invalid. Symbol '&' not followed by "
-                    "single symbol.");
-            }
-            lisp_value* next_symbol = lisp_value_pop(function->formals, 0);
-            lisp_environment_put(function->environment, next_symbol,
-                                 builtin_list(environment, arguments));
-            lisp_value_delete(symbol);
-            lisp_value_delete(next_symbol);
+        const lisp_node* node = lisp_node_of_body(function->body);
+        result = node->run(node, frame);
+        if (result != &lisp_closure_tail_call) {
             break;
         }
+        lisp_value* previous = function;
+        function = lisp_closure_function;
+        result = lisp_value_bind(frame, function, lisp_closure_arguments);
+        lisp_value_delete(previous);
+    }
+    lisp_closure_depth -= 1;
+    lisp_frame_pop();
+    lisp_value_delete(function);
+    return result;
+}
 
-        lisp_value* value = lisp_value_pop(arguments, 0);
-        lisp_environment_put(function->environment, symbol, value);
-        lisp_value_delete(symbol);
+/* Evaluate "value" through a tree that is thrown away afterwards */
+lisp_value* lisp_closure_evaluate(lisp_environment* const environment,
+                                  lisp_value* const value) {
+    if (lisp_closure_depth + lisp_vm_frame_count >=
+        lisp_evaluation_max_depth) {
         lisp_value_delete(value);
+        return lisp_evaluation_too_deep();
     }
-    lisp_value_delete(arguments);
+    if (lisp_closure_depth >= LISP_CLOSURE_MAX_DEPTH) {
+        return lisp_vm_evaluate(environment, value);
+    }
+    lisp_node* node = lisp_node_compile(value, false);
+    lisp_closure_depth += 1;
+    lisp_value* result = node->run(node, environment);
+    lisp_closure_depth -= 1;
+    lisp_node_free(node);
+    lisp_value_delete(value);
+    return result;
+}
 
-    /* If '&' remains in formal list, bind to empty list */
-    if (function->formals->count > 0 &&
-        strcmp(function->formals->cell[0]->symbol, "&") == 0) {
-        if (function->formals->count != 2) {
-            return lisp_value_error(
-                "Function format invalid. Symbol '&' not followed by single "
-                "symbol.");
+lisp_value* lisp_value_evaluate(lisp_environment* environment,
+                                lisp_value* value) {
+    switch (lisp_evaluation_engine) {
+        case LISP_ENGINE_TREE:
+            return lisp_value_evaluate_tree(environment, value);
+        case LISP_ENGINE_CLOSURES:
+            return lisp_closure_evaluate(environment, value);
+        default:
+            return lisp_vm_evaluate(environment, value);
+    }
+}
+
+/* Ahead-of-time compilation. "--compile FILE OUTPUT" reads FILE once and
+ * writes it out as C: a function for each top-level form that builds it with
+ * the value constructors. Built together with this file and -DLISP_PROGRAM
+ * (see "make program"), that gives a binary which evaluates the forms the
+ * way 'load' would, without reading or parsing anything. */
+#ifdef LISP_PROGRAM
+/* Defined by the C file --compile wrote */
+extern lisp_value* (*const lisp_program_forms[])(void);
+extern const size_t lisp_program_count;
+#endif
+
+/* Write "text" as a C string literal. '?' is escaped as well, as with
+ * -std=c99 "??/" and the like are trigraphs. */
+void lisp_program_write_text(FILE* const output, const char* const text) {
+    fputc('"', output);
+    for (const unsigned char* c = (const unsigned char*)text; *c != '\0';
+         c += 1) {
+        if (*c == '"' || *c == '\\' || *c == '?') {
+            fprintf(output, "\\%c", *c);
+        } else if (*c < ' ' || *c > '~') {
+            fprintf(output, "\\%03o", *c);
+        } else {
+            fputc(*c, output);
         }
-        lisp_value_delete(lisp_value_pop(function->formals, 0));
-        lisp_value* symbol = lisp_value_pop(function->formals, 0);
-        lisp_value* value = lisp_value_qexpression();
-        lisp_environment_put(function->environment, symbol, value);
-        lisp_value_delete(symbol);
-        lisp_value_delete(value);
     }
+    fputc('"', output);
+}
 
-    if (function->formals->count == 0) {
-        function->environment->parent = environment;
-        return builtin_eval(function->environment,
-                            lisp_value_add(lisp_value_sexpression(),
-                                           lisp_value_copy(function->body)));
-    } else {
-        /* Return partially evaluated function */
-        return lisp_value_copy(function);
+/* How many parts of "value" the walk has still to visit */
+size_t lisp_program_parts_left(const lisp_walk_frame* const frame) {
+    int type = lisp_value_type(frame->value);
+    if (type != LISP_VALUE_QEXPRESSION && type != LISP_VALUE_SEXPRESSION) {
+        return 0;
     }
+    return lisp_value_count(frame->value) - frame->next;
 }
 
-lisp_value* lisp_value_evaluate_sexpression(lisp_environment* const environment,
-                                            lisp_value* const value) {
-    if (value->count == 0) {
-        return value;
+/* How many levels "value" has, counting itself */
+size_t lisp_program_depth(const lisp_value* const value) {
+    size_t base = lisp_walk_stack.count;
+    size_t depth = 0;
+    lisp_walk_enter(value);
+    while (lisp_walk_stack.count > base) {
+        lisp_walk_frame* frame = lisp_walk_top();
+        if (lisp_walk_stack.count - base > depth) {
+            depth = lisp_walk_stack.count - base;
+        }
+        if (lisp_program_parts_left(frame) == 0) {
+            lisp_walk_stack.count -= 1;
+            continue;
+        }
+        frame->next += 1;
+        lisp_walk_enter(frame->value->cell[frame->next - 1]);
     }
+    return depth;
+}
 
-    for (size_t i = 0; i < value->count; i += 1) {
-        value->cell[i] = lisp_value_evaluate(environment, value->cell[i]);
-        if (value->cell[i]->type == LISP_VALUE_ERROR) {
-            return lisp_value_take(value, i);
+/* Write a statement that leaves "value" in x[level], or for an expression,
+ * an empty one to add its cells to */
+void lisp_program_write_node(FILE* const output,
+                             const lisp_value* const value,
+                             const size_t level) {
+    fprintf(output, "    x[%zu] = ", level);
+    switch (lisp_value_type(value)) {
+        case LISP_VALUE_NUMBER: {
+            long number = lisp_value_get_number(value);
+            if (number == LONG_MIN) {
+                fprintf(output, "lisp_value_number(-%ldL - 1);\n", LONG_MAX);
+            } else {
+                fprintf(output, "lisp_value_number(%ldL);\n", number);
+            }
+            break;
         }
+        case LISP_VALUE_ERROR:
+            fputs("lisp_value_error(\"%s\", ", output);
+            lisp_program_write_text(output, value->error);
+            fputs(");\n", output);
+            break;
+        case LISP_VALUE_SYMBOL:
+            fputs("lisp_value_symbol(", output);
+            lisp_program_write_text(output, value->symbol);
+            fputs(");\n", output);
+            break;
+        case LISP_VALUE_STRING:
+            fputs("lisp_value_string(", output);
+            lisp_program_write_text(output, value->string);
+            fputs(");\n", output);
+            break;
+        default:
+            /* The reader makes nothing else */
+            fprintf(output, "lisp_value_%s();\n",
+                    lisp_value_type(value) == LISP_VALUE_QEXPRESSION
+                        ? "qexpression"
+                        : "sexpression");
+            break;
     }
+}
 
-    if (value->count == 1) {
-        return lisp_value_take(value, 0);
+/* Write statements that leave "value" in x[level]. Each cell of an
+ * expression is built in the level below and then added. */
+void lisp_program_write_value(FILE* const output,
+                              const lisp_value* const value,
+                              const size_t level) {
+    size_t base = lisp_walk_stack.count;
+    lisp_program_write_node(output, value, level);
+    lisp_walk_enter(value);
+    while (lisp_walk_stack.count > base) {
+        lisp_walk_frame* frame = lisp_walk_top();
+        size_t at = level + lisp_walk_stack.count - base - 1;
+        if (lisp_program_parts_left(frame) > 0) {
+            const lisp_value* cell = frame->value->cell[frame->next];
+            frame->next += 1;
+            lisp_program_write_node(output, cell, at + 1);
+            lisp_walk_enter(cell);
+            continue;
+        }
+        lisp_walk_stack.count -= 1;
+        if (lisp_walk_stack.count > base) {
+            fprintf(output, "    x[%zu] = lisp_value_add(x[%zu], x[%zu]);\n",
+                    at - 1, at - 1, at);
+        }
     }
+}
 
-    lisp_value* first = lisp_value_pop(value, 0);
-    if (first->type != LISP_VALUE_FUNCTION) {
-        lisp_value_delete(value);
-        lisp_value* error = lisp_value_error(
-            "S-expression must start with a function. Got '%s'",
-            lisp_type_name(first->type));
-        lisp_value_delete(first);
-        return error;
+void lisp_program_write(FILE* const output, const char* const name,
+                        const lisp_value* const forms) {
+    fputs("/* Generated by --compile from ", output);
+    lisp_program_write_text(output, name);
+    fputs(" */\n"
+          "#include <stddef.h>\n\n"
+          "typedef struct lisp_value lisp_value;\n\n"
+          "lisp_value* lisp_value_number(const long x);\n"
+          "lisp_value* lisp_value_error(const char* const fmt, ...);\n"
+          "lisp_value* lisp_value_symbol(const char* const s);\n"
+          "lisp_value* lisp_value_string(const char* const string);\n"
+          "lisp_value* lisp_value_qexpression();\n"
+          "lisp_value* lisp_value_sexpression();\n"
+          "lisp_value* lisp_value_add(lisp_value* value, lisp_value* const x);"
+          "\n",
+          output);
+    size_t count = lisp_value_count(forms);
+    for (size_t i = 0; i < count; i += 1) {
+        fprintf(output,
+                "\nstatic lisp_value* lisp_program_form_%zu(void) {\n"
+                "    lisp_value* x[%zu];\n",
+                i, lisp_program_depth(forms->cell[i]));
+        lisp_program_write_value(output, forms->cell[i], 0);
+        fputs("    return x[0];\n}\n", output);
     }
+    fputs("\nlisp_value* (*const lisp_program_forms[])(void) = {", output);
+    for (size_t i = 0; i < count; i += 1) {
+        fprintf(output, "%s\n    lisp_program_form_%zu", i > 0 ? "," : "",
+                i);
+    }
+    fprintf(output, "%s};\n", count > 0 ? "\n" : "NULL");
+    fprintf(output, "const size_t lisp_program_count = %zu;\n", count);
+}
 
-    lisp_value* result = lisp_value_call(environment, first, value);
-    lisp_value_delete(first);
-    return result;
+#ifdef LISP_PROGRAM
+void lisp_program_run(lisp_environment* const environment) {
+    for (size_t i = 0; i < lisp_program_count; i += 1) {
+        /* Build the form outside the arena, as 'load' reads its file */
+        lisp_value* form = lisp_program_forms[i]();
+        lisp_evaluation_begin();
+        lisp_load_evaluate(environment, form, NULL);
+        lisp_evaluation_end();
+    }
 }
+#endif
 
-lisp_value* lisp_value_evaluate(lisp_environment* const environment,
-                                lisp_value* const value) {
-    if (value->type == LISP_VALUE_SYMBOL) {
-        lisp_value* x = lisp_environment_get(environment, value);
-        lisp_value_delete(value);
-        return x;
+/* Write the forms of the file "input" as C to the file "output_name" */
+int lisp_program_compile(const char* const input,
+                         const char* const output_name) {
+    lisp_value* forms = lisp_read_file(input);
+    if (lisp_value_type(forms) == LISP_VALUE_ERROR) {
+        fprintf(stderr, "%s\n", forms->error);
+        lisp_value_delete(forms);
+        return 1;
     }
-    if (value->type == LISP_VALUE_SEXPRESSION) {
-        return lisp_value_evaluate_sexpression(environment, value);
+    FILE* output = fopen(output_name, "w");
+    if (output == NULL) {
+        perror(output_name);
+        lisp_value_delete(forms);
+        return 1;
     }
-    return value;
+    lisp_program_write(output, input, forms);
+    lisp_value_delete(forms);
+    return fclose(output) == 0 ? 0 : 1;
 }
 
 void lisp_environment_add_builtin(lisp_environment* const environment,
@@ -1149,8 +6741,18 @@ void lisp_environment_add_builtins(lisp_environment* const environment) {
     lisp_environment_add_builtin(environment, "=", builtin_put);
 
     lisp_environment_add_builtin(environment, "load", builtin_load);
+    lisp_environment_add_builtin(environment, "save-value",
+                                 builtin_save_value);
+    lisp_environment_add_builtin(environment, "load-value",
+                                 builtin_load_value);
     lisp_environment_add_builtin(environment, "print", builtin_print);
+    lisp_environment_add_builtin(environment, "to-string", builtin_to_string);
     lisp_environment_add_builtin(environment, "error", builtin_error);
+    lisp_environment_add_builtin(environment, "gc", builtin_gc);
+    lisp_environment_add_builtin(environment, "gc-stats", builtin_gc_stats);
+    lisp_environment_add_builtin(environment, "load-stats",
+                                 builtin_load_stats);
+    lisp_environment_add_builtin(environment, "jit-stats", builtin_jit_stats);
 
     lisp_environment_add_builtin(environment, "list", builtin_list);
     lisp_environment_add_builtin(environment, "head", builtin_head);
@@ -1158,97 +6760,193 @@ void lisp_environment_add_builtins(lisp_environment* const environment) {
     lisp_environment_add_builtin(environment, "join", builtin_join);
     lisp_environment_add_builtin(environment, "eval", builtin_eval);
 
-    lisp_environment_add_builtin(environment, "add", builtin_add);
-    lisp_environment_add_builtin(environment, "+", builtin_add);
-    lisp_environment_add_builtin(environment, "sub", builtin_sub);
-    lisp_environment_add_builtin(environment, "-", builtin_sub);
-    lisp_environment_add_builtin(environment, "mul", builtin_mul);
-    lisp_environment_add_builtin(environment, "*", builtin_mul);
-    lisp_environment_add_builtin(environment, "div", builtin_div);
-    lisp_environment_add_builtin(environment, "/", builtin_div);
-    lisp_environment_add_builtin(environment, "mod", builtin_mod);
-    lisp_environment_add_builtin(environment, "%", builtin_mod);
+#define X(name, symbol, word, kind)                                    \
+    lisp_environment_add_builtin(environment, symbol, builtin_##name); \
+    lisp_environment_add_builtin(environment, word, builtin_##name);
+    LISP_ARITHMETIC(X)
+    LISP_ORDER(X)
+    LISP_EQUALITY(X)
+#undef X
 
     lisp_environment_add_builtin(environment, "if", builtin_if);
-    lisp_environment_add_builtin(environment, "==", builtin_equal);
-    lisp_environment_add_builtin(environment, "eq", builtin_equal);
-    lisp_environment_add_builtin(environment, "!=", builtin_not_equal);
-    lisp_environment_add_builtin(environment, "ne", builtin_not_equal);
-    lisp_environment_add_builtin(environment, ">", builtin_greater_than);
-    lisp_environment_add_builtin(environment, "gt", builtin_greater_than);
-    lisp_environment_add_builtin(environment, "<", builtin_lesser_than);
-    lisp_environment_add_builtin(environment, "lt", builtin_lesser_than);
-    lisp_environment_add_builtin(environment, ">=",
-                                 builtin_greater_than_or_equal_to);
-    lisp_environment_add_builtin(environment, "ge",
-                                 builtin_greater_than_or_equal_to);
-    lisp_environment_add_builtin(environment, "<=",
-                                 builtin_lesser_than_or_equal_to);
-    lisp_environment_add_builtin(environment, "le",
-                                 builtin_lesser_than_or_equal_to);
 }
 
 int main(int argc, char** argv) {
-    Number = mpc_new("number");
-    String = mpc_new("string");
-    Symbol = mpc_new("symbol");
-    Comment = mpc_new("comment");
-    Qexpression = mpc_new("qexpression");
-    Sexpression = mpc_new("sexpression");
-    Expression = mpc_new("expression");
-    Lispy = mpc_new("lispy");
-
-    mpca_lang(MPCA_LANG_DEFAULT,
-              "\
-            number: /-?[0-9]+/ ;\
-            string: /\"(\\\\.|[^\"])*\"/ ;\
-            symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;\
-            comment: /;[^\\r\\n]*/;\
-            qexpression: '{' <expression>* '}';\
-            sexpression: '(' <expression>* ')';\
-            expression: <number> | <string> | <symbol> | <sexpression> \
-                        | <qexpression> ;\
-            lispy: /^/ <expression>* /$/;\
-            ",
-              Number, String, Symbol, Comment, Qexpression, Sexpression,
-              Expression, Lispy);
+    lisp_stack_init(&argc);
+    int first_file = 1;
+    const char* compile_input = NULL;
+    const char* compile_output = NULL;
+    const char* image_input = NULL;
+    const char* image_output = NULL;
+    const char** expressions = malloc(sizeof(char*) * argc);
+    size_t expression_count = 0;
+    while (first_file < argc && argv[first_file][0] == '-' &&
+           argv[first_file][1] != '\0') {
+        if (strcmp(argv[first_file], "-e") == 0 && first_file + 1 < argc) {
+            expressions[expression_count] = argv[first_file + 1];
+            expression_count += 1;
+            first_file += 2;
+        } else if (strcmp(argv[first_file], "--quiet") == 0) {
+            lisp_load_quiet = true;
+            first_file += 1;
+        } else if (strcmp(argv[first_file], "--max-depth") == 0 &&
+                   first_file + 1 < argc) {
+            lisp_evaluation_max_depth =
+                strtoul(argv[first_file + 1], NULL, 10);
+            first_file += 2;
+        } else if (strcmp(argv[first_file], "--tree-walker") == 0) {
+            lisp_evaluation_engine = LISP_ENGINE_TREE;
+            first_file += 1;
+        } else if (strcmp(argv[first_file], "--closures") == 0) {
+            lisp_evaluation_engine = LISP_ENGINE_CLOSURES;
+            first_file += 1;
+        } else if (strcmp(argv[first_file], "--jit") == 0) {
+#ifndef LISP_JIT_NATIVE
+            fputs("The JIT only supports x86-64 Linux.\n", stderr);
+#endif
+            lisp_jit_enabled = true;
+            first_file += 1;
+        } else if (strcmp(argv[first_file], "--no-simd") == 0) {
+            lisp_scan_simd = false;
+            first_file += 1;
+        } else if (strcmp(argv[first_file], "--read-threads") == 0 &&
+                   first_file + 1 < argc) {
+#ifndef LISP_READ_THREADS
+            fputs("Reading on threads needs thread-local storage.\n", stderr);
+#endif
+            lisp_read_threads = strtoul(argv[first_file + 1], NULL, 10);
+            if (lisp_read_threads == 0) {
+                lisp_read_threads = 1;
+            }
+            first_file += 2;
+        } else if (strcmp(argv[first_file], "--no-disk-cache") == 0) {
+            lisp_load_disk_cache = false;
+            first_file += 1;
+        } else if (strcmp(argv[first_file], "--mpc-reader") == 0) {
+            lisp_reader_mpc = true;
+            first_file += 1;
+        } else if (strcmp(argv[first_file], "--bench-reader") == 0 &&
+                   first_file + 1 < argc) {
+            return lisp_read_benchmark(argv[first_file + 1]);
+        } else if (strcmp(argv[first_file], "--bench-memory") == 0 &&
+                   first_file + 1 < argc) {
+            return lisp_memory_benchmark(argv[first_file + 1]);
+        } else if (strcmp(argv[first_file], "--bench-fasl") == 0 &&
+                   first_file + 1 < argc) {
+            return lisp_fasl_benchmark(argv[first_file + 1]);
+        } else if (strcmp(argv[first_file], "--image") == 0 &&
+                   first_file + 1 < argc) {
+            image_input = argv[first_file + 1];
+            first_file += 2;
+        } else if (strcmp(argv[first_file], "--dump-image") == 0 &&
+                   first_file + 1 < argc) {
+            image_output = argv[first_file + 1];
+            first_file += 2;
+        } else if (strcmp(argv[first_file], "--compile") == 0 &&
+                   first_file + 2 < argc) {
+            compile_input = argv[first_file + 1];
+            compile_output = argv[first_file + 2];
+            first_file += 3;
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[first_file]);
+            return 1;
+        }
+    }
 
+    lisp_symbol_ampersand = lisp_symbol_intern("&");
+    lisp_symbol_if = lisp_symbol_intern("if");
     lisp_environment* environment = lisp_environment_new();
     lisp_environment_add_builtins(environment);
-    puts("Lispy Version 00.00.11");
-    puts("Press Ctrl+c to Exit\n");
+    lisp_gc_environment = environment;
+    if (image_input != NULL) {
+        lisp_value* x = lisp_image_load(image_input, environment);
+        if (lisp_value_type(x) == LISP_VALUE_ERROR) {
+            fprintf(stderr, "%s\n", x->error);
+            lisp_value_delete(x);
+            lisp_environment_delete(environment);
+            free(expressions);
+            return 1;
+        }
+        lisp_value_delete(x);
+    }
+    if (compile_input != NULL) {
+        int status = lisp_program_compile(compile_input, compile_output);
+        lisp_environment_delete(environment);
+        free(expressions);
+        return status;
+    }
+#ifdef LISP_PROGRAM
+    lisp_program_run(environment);
+#else
+    /* -e, - and --quiet run without the banner or the prompt */
+    bool batch = expression_count > 0 || lisp_load_quiet;
+    for (int i = first_file; i < argc; i += 1) {
+        batch = batch || strcmp(argv[i], "-") == 0;
+    }
+    if (!batch) {
+        puts("Lispy Version 00.00.11");
+        puts("Press Ctrl+c to Exit\n");
+    }
 
-    if (argc >= 2) {
-        for (int i = 1; i < argc; i += 1) {
+    /* Expressions given with -e go first, then the files in order */
+    for (size_t i = 0; i < expression_count; i += 1) {
+        lisp_load_finish(lisp_load_text(environment, "-e", expressions[i],
+                                        strlen(expressions[i])));
+    }
+    for (int i = first_file; i < argc; i += 1) {
+        if (strcmp(argv[i], "-") == 0) {
+            size_t length;
+            char* text = lisp_read_stream(stdin, &length);
+            lisp_load_finish(
+                text != NULL
+                    ? lisp_load_text(environment, "<stdin>", text, length)
+                    : lisp_value_error("<stdin>: error: Unable to read!"));
+            free(text);
+        } else {
             lisp_value* arguments = lisp_value_add(lisp_value_sexpression(),
                                                    lisp_value_string(argv[i]));
-            lisp_value* x = builtin_load(environment, arguments);
-            if (x->type == LISP_VALUE_ERROR) {
-                lisp_value_println(x);
-            }
-            lisp_value_delete(x);
+            lisp_load_finish(builtin_load(environment, arguments));
         }
-    } else if (argc == 1) {
+    }
+    /* With --dump-image, save what the files loaded instead of prompting */
+    if (argc <= first_file && image_output == NULL && !batch) {
         for (;;) {
             char* input = readline("lispy> ");
+            if (input == NULL) {
+                break;
+            }
             add_history(input);
-            mpc_result_t r;
-            if (mpc_parse("<stdin>", input, Lispy, &r)) {
-                lisp_value* x =
-                    lisp_value_evaluate(environment, lisp_value_read(r.output));
+            lisp_value* forms = lisp_read_text("<stdin>", input, strlen(input));
+            if (lisp_value_type(forms) != LISP_VALUE_ERROR) {
+                lisp_evaluation_begin();
+                lisp_value* x = lisp_value_evaluate(environment, forms);
                 lisp_value_println(x);
                 lisp_value_delete(x);
-                mpc_ast_delete(r.output);
+                lisp_evaluation_end();
             } else {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+                lisp_value_println(forms);
+                lisp_value_delete(forms);
             }
             free(input);
         }
     }
+#endif
+    free(expressions);
+    int status = lisp_load_errors > 0 ? 1 : 0;
+    if (image_output != NULL) {
+        lisp_value* x = lisp_image_dump(image_output, environment);
+        if (lisp_value_type(x) == LISP_VALUE_ERROR) {
+            fprintf(stderr, "%s\n", x->error);
+            status = 1;
+        }
+        lisp_value_delete(x);
+    }
     lisp_environment_delete(environment);
+    lisp_jit_free_all();
 
-    mpc_cleanup(8, Number, String, Symbol, Comment, Qexpression, Sexpression,
-                Expression, Lispy);
-    return 0;
+    if (Lispy != NULL) {
+        mpc_cleanup(8, Number, String, Symbol, Comment, Qexpression,
+                    Sexpression, Expression, Lispy);
+    }
+    return status;
 }
@@ -0,0 +1,14 @@
+# Batch mode: -e, - for stdin, --quiet and the exit status. "make test" runs
+# this with the interpreter as $1.
+lispy=$1
+echo "Expressions given with -e run in order, showing values unless --quiet"
+$lispy -e '(+ 1 2)' -e '(print "second")' </dev/null; echo "status $?"
+$lispy --quiet -e '(+ 1 2)' -e '(def {x} 4)' -e '(print x)'; echo "status $?"
+echo "A program named - is read from stdin"
+echo '(print "from stdin") (+ 5 6)' | $lispy -; echo "status $?"
+echo '(print x)' | $lispy --quiet -e '(def {x} 7)' -; echo "status $?"
+echo 'An error in any form makes the status 1, and the forms after it still run'
+$lispy --quiet -e '(+ 1 {})' -e '(print "after")' 2>&1; echo "status $?"
+$lispy -e '(+ 1 {})' </dev/null 2>&1; echo "status $?"
+echo '(print "before") (head {}' | $lispy --quiet - 2>&1; echo "status $?"
+$lispy --quiet tests/files/missing.lspy 2>&1; echo "status $?"